@@ -0,0 +1,103 @@
+/*
+    Configuration arena
+
+    Everything a setup is built from - the setup itself, its channel sets,
+    tables and their names, the table pool, key and range maps, splits,
+    bend curves, SysEx rules, controller values gathered while parsing and
+    the compiled plan tables - is carved out of a few large blocks rather
+    than taken from AllocMem() one piece at a time. Nothing is freed on its
+    own: freeArena() hands back the blocks with one FreeMem() each when the
+    setup goes, so repeated reloads do not leave small holes all over a
+    machine with little memory. Only the config file buffer is separate,
+    and it is freed as soon as parsing ends.
+
+    The first block of a load is sized from what the previous load used,
+    so after the first load of a config a reload normally takes a single
+    block.
+*/
+
+#include "midimapper.h"
+#include <string.h>
+
+#define ARENA_ALIGN      sizeof(void*)
+
+struct ArenaBlock_t {
+    ArenaBlock* next;
+    uint32      size;                             /* bytes after the header */
+    uint32      used;
+};
+
+static uint32 arenaHint = ARENA_BLOCK;            /* first block of the next load */
+
+/**************************************************************************/
+
+void* arenaAlloc(Arena* a, uint32 size) {
+    /* cleared, aligned memory that lasts as long as the arena; 0 if out of memory */
+    ArenaBlock* b = a->blocks;
+    uint8*      p;
+    size = (size + ARENA_ALIGN - 1) & ~(uint32)(ARENA_ALIGN - 1);
+    if (!b || b->used + size > b->size) {
+        uint32      blockSize = b ? ARENA_BLOCK : arenaHint;
+        ArenaBlock* nb;
+        if (blockSize < size) {
+            blockSize = size;
+        }
+        if (!(nb = (ArenaBlock*)AllocMem(sizeof(ArenaBlock) + blockSize, MEMF_PUBLIC | MEMF_CLEAR))) {
+            return 0;
+        }
+        nb->size  = blockSize;
+        a->size  += blockSize;
+        a->numBlocks++;
+        if (b && blockSize == size) {
+            /* a block of its own, the current one stays in use */
+            nb->used  = size;
+            nb->next  = b->next;
+            b->next   = nb;
+            a->used  += size;
+            return nb + 1;
+        }
+        /* the rest of a full block is left unused */
+        nb->next  = a->blocks;
+        a->blocks = b = nb;
+    }
+    p        = (uint8*)(b + 1) + b->used;
+    b->used += size;
+    a->used += size;
+    return p;
+}
+
+/**************************************************************************/
+
+char* arenaString(Arena* a, const char* s) {
+    /* a copy of a string */
+    char* p = (char*)arenaAlloc(a, strlen(s) + 1);
+    if (p) {
+        strcpy(p, s);
+    }
+    return p;
+}
+
+/**************************************************************************/
+
+void reportArena(const Arena* a) {
+    /* prints the high-water mark of a loaded setup and sizes the next load to it */
+    printf("config arena: %lu bytes used of %lu in %ld block%s\n",
+        (unsigned long)a->used, (unsigned long)a->size, (long)a->numBlocks, a->numBlocks == 1 ? "" : "s");
+    arenaHint = a->used + a->used / 8 + 256;
+}
+
+/**************************************************************************/
+
+void freeArena(Arena* a) {
+    /* frees everything allocated from the arena, which may itself be in it */
+    ArenaBlock* b = a->blocks;
+    ArenaBlock* next;
+    a->blocks    = 0;
+    a->size      = 0;
+    a->used      = 0;
+    a->numBlocks = 0;
+    for (; b; b = next) {
+        next = b->next;
+        FreeMem(b, sizeof(ArenaBlock) + b->size);
+    }
+}
@@ -0,0 +1,380 @@
+/*
+    Block remapping
+
+    Bulk work such as file conversion can remap messages a block at a time
+    instead of one by one. A block holds up to BLOCK_EVENTS channel or
+    system messages as three columns, status, data1 and data2 (SysEx is
+    not carried). remapBlock() produces exactly the bytes, channel state
+    and counters remapMIDIData() would for the same messages in turn, and
+    notes where the output of each message ends.
+
+    It works in two passes. The first maps the status and data bytes of
+    the whole block through the channels' tables without looking at any
+    state: the output channel, and by message type the key, velocity,
+    controller number and pressure maps. The tables of all 16 channels are
+    kept side by side in one flat image in the BlockPlan, refreshed when a
+    channel's tables change, so every lookup is one indexed load. On x86
+    hosts with AVX2 eight messages are mapped at a time, the status bytes
+    through a byte shuffle and the data bytes through gathers; elsewhere a
+    plain loop does the same lookups with the same results.
+
+    The second pass goes through the block in order for what depends on
+    state: note tracking, controller suppression and program changes, and
+    hands every message the first pass has no tables for to the channel's
+    handler.
+*/
+
+#include "midimapper.h"
+#include <string.h>
+
+#if defined(MIDIMAPPER_HOST) && (defined(__x86_64__) || defined(__i386__))
+#define BLOCK_AVX2
+#include <immintrin.h>
+#endif
+
+extern TASK_LOCAL Channel* channels;
+
+/* slices of the lookup image */
+#define LUT_KEY      0
+#define LUT_VELOCITY 1
+#define LUT_CTRL     2
+#define LUT_PRESSURE 3
+#define LUT_IDENTITY 4
+
+#define LUT_SLICE    (MIDI_NUM_CHANNELS * MIDI_TABLE_SIZE)
+
+/* slice for data1 and data2 by status nybble 8 to F */
+static const uint8 lutData1[8] = {
+    LUT_KEY, LUT_KEY, LUT_KEY, LUT_CTRL, LUT_IDENTITY, LUT_PRESSURE, LUT_IDENTITY, LUT_IDENTITY
+};
+static const uint8 lutData2[8] = {
+    LUT_VELOCITY, LUT_VELOCITY, LUT_PRESSURE, LUT_IDENTITY, LUT_IDENTITY, LUT_IDENTITY, LUT_IDENTITY, LUT_IDENTITY
+};
+
+#ifdef BLOCK_AVX2
+static sint32 haveAVX2 = -1;
+#endif
+
+/**************************************************************************/
+
+void initBlockPlan(BlockPlan* bp, bool simd) {
+    /* simd false keeps to the plain lookups, for comparison */
+    sint32 i, j;
+    memset(bp, 0, sizeof(BlockPlan));
+    for (j = 0; j < MIDI_NUM_CHANNELS; j++) {
+        for (i = 0; i < MIDI_TABLE_SIZE; i++) {
+            bp->lut[LUT_IDENTITY * LUT_SLICE + j * MIDI_TABLE_SIZE + i] = i;
+        }
+    }
+#ifdef BLOCK_AVX2
+    if (haveAVX2 < 0) {
+        haveAVX2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    bp->simd = simd && haveAVX2;
+#else
+    bp->simd = false;
+#endif
+}
+
+/**************************************************************************/
+
+static void refreshBlockPlan(BlockPlan* bp) {
+    /* copies in any table of the active channels that has changed */
+    sint32 i, k;
+    for (i = 0; i < MIDI_NUM_CHANNELS; i++) {
+        const Channel* c = &channels[i];
+        const uint8*   src[LUT_IDENTITY];
+        src[LUT_KEY]      = c->keyTable;
+        src[LUT_VELOCITY] = c->velTable;
+        src[LUT_CTRL]     = c->ctrlTable;
+        src[LUT_PRESSURE] = c->pressTable;
+        for (k = 0; k < LUT_IDENTITY; k++) {
+            if (bp->source[k][i] != src[k]) {
+                bp->source[k][i] = src[k];
+                memcpy(bp->lut + k * LUT_SLICE + i * MIDI_TABLE_SIZE, src[k], MIDI_TABLE_SIZE);
+            }
+        }
+        bp->output[i] = c->output;
+    }
+}
+
+/**************************************************************************/
+
+static void mapBlock(const BlockPlan* bp, const EventBlock* b, sint32 from, uint8* st, uint8* m1, uint8* m2) {
+    /* first pass, plain version: messages from..count */
+    sint32 i;
+    for (i = from; i < b->count; i++) {
+        sint32 s  = b->status[i];
+        sint32 t  = (s >> 4) & 7;
+        sint32 ch = (s & 0x0F) * MIDI_TABLE_SIZE;
+        st[i] = (s & 0xF0) | bp->output[s & 0x0F];
+        m1[i] = bp->lut[lutData1[t] * LUT_SLICE + ch + b->data1[i]];
+        m2[i] = bp->lut[lutData2[t] * LUT_SLICE + ch + b->data2[i]];
+    }
+}
+
+#ifdef BLOCK_AVX2
+__attribute__((target("avx2")))
+static void store8(uint8* p, __m256i v) {
+    /* low bytes of 8 dwords */
+    const __m256i pick = _mm256_setr_epi8(
+        0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+    );
+    __m256i x  = _mm256_shuffle_epi8(v, pick);
+    uint32  lo = (uint32)_mm_cvtsi128_si32(_mm256_castsi256_si128(x));
+    uint32  hi = (uint32)_mm_cvtsi128_si32(_mm256_extracti128_si256(x, 1));
+    memcpy(p, &lo, 4);
+    memcpy(p + 4, &hi, 4);
+}
+
+__attribute__((target("avx2")))
+static void mapBlockAVX2(const BlockPlan* bp, const EventBlock* b, uint8* st, uint8* m1, uint8* m2) {
+    /* first pass, 8 messages at a time: status by byte shuffle, data by gathers */
+    const __m128i outputs = _mm_loadu_si128((const __m128i*)bp->output);
+    const __m128i low     = _mm_set1_epi8(0x0F);
+    const __m128i high    = _mm_set1_epi8((char)0xF0);
+    const __m256i seven   = _mm256_set1_epi32(7);
+    const __m256i fifteen = _mm256_set1_epi32(15);
+    const __m256i byte    = _mm256_set1_epi32(0xFF);
+    const __m256i slice1  = _mm256_setr_epi32(
+        lutData1[0] * LUT_SLICE, lutData1[1] * LUT_SLICE, lutData1[2] * LUT_SLICE, lutData1[3] * LUT_SLICE,
+        lutData1[4] * LUT_SLICE, lutData1[5] * LUT_SLICE, lutData1[6] * LUT_SLICE, lutData1[7] * LUT_SLICE
+    );
+    const __m256i slice2  = _mm256_setr_epi32(
+        lutData2[0] * LUT_SLICE, lutData2[1] * LUT_SLICE, lutData2[2] * LUT_SLICE, lutData2[3] * LUT_SLICE,
+        lutData2[4] * LUT_SLICE, lutData2[5] * LUT_SLICE, lutData2[6] * LUT_SLICE, lutData2[7] * LUT_SLICE
+    );
+    const int* lut = (const int*)bp->lut;
+    sint32     i;
+    for (i = 0; i + 8 <= b->count; i += 8) {
+        __m128i s8 = _mm_loadl_epi64((const __m128i*)(b->status + i));
+        __m128i o  = _mm_shuffle_epi8(outputs, _mm_and_si128(s8, low));
+        __m256i s  = _mm256_cvtepu8_epi32(s8);
+        __m256i d1 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(b->data1 + i)));
+        __m256i d2 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(b->data2 + i)));
+        __m256i t  = _mm256_and_si256(_mm256_srli_epi32(s, 4), seven);
+        __m256i ch = _mm256_slli_epi32(_mm256_and_si256(s, fifteen), 7);
+        __m256i i1 = _mm256_add_epi32(_mm256_add_epi32(_mm256_permutevar8x32_epi32(slice1, t), ch), d1);
+        __m256i i2 = _mm256_add_epi32(_mm256_add_epi32(_mm256_permutevar8x32_epi32(slice2, t), ch), d2);
+        store8(m1 + i, _mm256_and_si256(_mm256_i32gather_epi32(lut, i1, 1), byte));
+        store8(m2 + i, _mm256_and_si256(_mm256_i32gather_epi32(lut, i2, 1), byte));
+        _mm_storel_epi64((__m128i*)(st + i), _mm_or_si128(_mm_and_si128(s8, high), o));
+    }
+    /* the last few the plain way */
+    mapBlock(bp, b, i, st, m1, m2);
+}
+#endif
+
+/**************************************************************************/
+
+sint32 remapBlock(BlockPlan* bp, EventBlock* b, uint8* dBuf) {
+    /*
+        Remaps a block through the active channels. dBuf must hold
+        BLOCK_EVENTS * REMAP_MAX_OUTPUT bytes. Sets b->end[] and returns
+        the bytes written.
+    */
+    uint8  st[BLOCK_EVENTS], m1[BLOCK_EVENTS], m2[BLOCK_EVENTS];
+    uint32 stale = 0;                             /* channels whose key map changed */
+    sint32 i, len = 0;
+    refreshBlockPlan(bp);
+#ifdef BLOCK_AVX2
+    if (bp->simd) {
+        mapBlockAVX2(bp, b, st, m1, m2);
+    }
+    else
+#endif
+    mapBlock(bp, b, 0, st, m1, m2);
+
+    for (i = 0; i < b->count; i++) {
+        uint8    msg[3];
+        uint8*   d   = dBuf + len;
+        sint32   s   = b->status[i];
+        sint32   ch  = s & 0x0F;
+        sint32   key = b->data1[i];
+        Channel* c   = &channels[ch];
+        sint32   n   = 0;
+        msg[0] = s;
+        msg[1] = key;
+        msg[2] = b->data2[i];
+        switch (s & 0xF0) {
+            case MS_NOTEON:
+                if (!(c->blockFast & BLOCK_NOTES)) {
+                    goto handler;
+                }
+                if (msg[2]) {
+                    /* as remapNoteOn() */
+                    sint32 k = stale & (1UL << ch) ? c->keyTable[key] : m1[i];
+                    n = releaseKey(c, d, key, MS_NOTEOFF, 0);
+                    c->noteBits[key >> 5] |= 1UL << (key & 31);
+                    c->noteKey[key] = d[n + 1] = k;
+                    c->noteOut[key] = c->output;
+                    d[n]     = st[i];
+                    d[n + 2] = m2[i];
+                    n += 3;
+                    break;
+                }
+                /* velocity 0 is a note off */
+            case MS_NOTEOFF:
+                if (!(c->blockFast & BLOCK_NOTES)) {
+                    goto handler;
+                }
+                /* as remapNoteOff() */
+                if (!(n = releaseKey(c, d, key, s & 0xF0, m2[i]))) {
+                    d[0] = st[i];
+                    d[1] = stale & (1UL << ch) ? c->keyTable[key] : m1[i];
+                    d[2] = m2[i];
+                    n    = 3;
+                }
+                break;
+            case MS_CTRL:
+                if (!(c->blockFast & BLOCK_CTRL)) {
+                    goto handler;
+                }
+                /* as remapCtrl() */
+                {
+                    sint32 val = c->plans[c->ctrlRange[key]][msg[2]];
+                    if (c->noSuppress || sendControl(c->output, m1[i], val)) {
+                        d[0] = st[i];
+                        d[1] = m1[i];
+                        d[2] = val;
+                        n    = 3;
+                    }
+                }
+                break;
+            case MS_PROG:
+                stale |= 1UL << ch;
+                /* fall through */
+            default:
+            handler:
+                n = c->remap[(s >> 4) & 7](c, d, msg, statusDataLength(s) + 1);
+                break;
+        }
+        countRemap(msg, d, n);
+        len     += n;
+        b->end[i] = len;
+    }
+    return len;
+}
+
+/**************************************************************************/
+
+bool benchBlock(sint32 count) {
+    /*
+        Times remapMIDIData() one message at a time against remapBlock(),
+        plain and with SIMD, on a generated mix of messages, and checks all
+        three give the same bytes and leave the same channel state.
+    */
+    static const uint8 mix[16] = {
+        MS_NOTEON, MS_NOTEON, MS_NOTEON, MS_NOTEON, MS_NOTEOFF, MS_NOTEOFF, MS_NOTEON, MS_NOTEOFF,
+        MS_CTRL, MS_CTRL, MS_CTRL, MS_PITCHBEND, MS_CHANPRESS, MS_POLYPRESS, MS_PROG, MS_CLOCK
+    };
+    static BlockPlan bp;
+    static EventBlock b;
+    Channel* start;
+    Channel* end;
+    uint8*   msgs;
+    uint8*   out[3];
+    uint32   outLen[3];
+    float64  secs[3];
+    uint32   rate = stampRate();
+    uint32   seed = 12345;
+    sint32   i, run, size = count * REMAP_MAX_OUTPUT;
+    bool     same = true;
+    Traffic  before = traffic;
+    if (!rate) {
+        puts("*** benchmark needs the E-clock");
+        return false;
+    }
+    start = (Channel*)AllocMem(sizeof(Channel) * MIDI_NUM_CHANNELS * 2, MEMF_PUBLIC);
+    msgs  = (uint8*)AllocMem(count * 3, MEMF_PUBLIC);
+    for (run = 0; run < 3; run++) {
+        out[run] = (uint8*)AllocMem(size, MEMF_PUBLIC);
+    }
+    if (!start || !msgs || !out[0] || !out[1] || !out[2]) {
+        puts("*** unable to allocate benchmark buffers");
+        same = false;
+        goto cleanup;
+    }
+    end = start + MIDI_NUM_CHANNELS;
+    for (i = 0; i < count; i++) {
+        /* a little generator: mostly notes and controllers, all channels */
+        uint8* m = msgs + i * 3;
+        seed = seed * 1103515245 + 12345;
+        m[0] = mix[(seed >> 8) & 15];
+        if (m[0] < MS_SYSEX) {
+            m[0] |= (seed >> 12) & 15;
+        }
+        m[1] = (seed >> 16) & 127;
+        m[2] = (seed >> 23) & 127;
+        if (m[0] == MS_CLOCK) {
+            m[1] = m[2] = 0;
+        }
+    }
+
+    memcpy(start, channels, sizeof(Channel) * MIDI_NUM_CHANNELS);
+    for (run = 0; run < 3; run++) {
+        uint8* d = out[run];
+        uint32 t;
+        memcpy(channels, start, sizeof(Channel) * MIDI_NUM_CHANNELS);
+        clearShadow();
+        initBlockPlan(&bp, run == 2);
+        t = readStamp();
+        if (run == 0) {
+            for (i = 0; i < count; i++) {
+                uint8* m = msgs + i * 3;
+                d += remapMIDIData(d, m, statusDataLength(m[0]) + 1);
+            }
+        }
+        else {
+            for (i = 0; i < count; i += b.count) {
+                sint32 j;
+                b.count = count - i < BLOCK_EVENTS ? count - i : BLOCK_EVENTS;
+                for (j = 0; j < b.count; j++) {
+                    b.status[j] = msgs[(i + j) * 3];
+                    b.data1[j]  = msgs[(i + j) * 3 + 1];
+                    b.data2[j]  = msgs[(i + j) * 3 + 2];
+                }
+                d += remapBlock(&bp, &b, d);
+            }
+        }
+        secs[run]   = (uint32)(readStamp() - t) / (float64)rate;
+        outLen[run] = d - out[run];
+        if (run == 0) {
+            memcpy(end, channels, sizeof(Channel) * MIDI_NUM_CHANNELS);
+        }
+        else if (
+            outLen[run] != outLen[0] || memcmp(out[run], out[0], outLen[0]) ||
+            memcmp(end, channels, sizeof(Channel) * MIDI_NUM_CHANNELS)
+        ) {
+            printf("*** block remap %s differs from remapMIDIData()\n", run == 2 ? "with SIMD" : "plain");
+            same = false;
+        }
+    }
+    memcpy(channels, start, sizeof(Channel) * MIDI_NUM_CHANNELS);
+    printf("%ld messages, %lu bytes out\n", (long)count, (unsigned long)outLen[0]);
+    printf("remapMIDIData %10.0f messages/s\n", count / (secs[0] > 0 ? secs[0] : 1e-9));
+    printf("block, plain  %10.0f messages/s\n", count / (secs[1] > 0 ? secs[1] : 1e-9));
+    if (bp.simd) {
+        printf("block, SIMD   %10.0f messages/s\n", count / (secs[2] > 0 ? secs[2] : 1e-9));
+    }
+    else {
+        printf("block, SIMD   not available\n");
+    }
+    printf("output %s\n", same ? "identical" : "differs");
+
+cleanup:
+    traffic = before;
+    for (run = 0; run < 3; run++) {
+        if (out[run]) {
+            FreeMem(out[run], size);
+        }
+    }
+    if (msgs) {
+        FreeMem(msgs, count * 3);
+    }
+    if (start) {
+        FreeMem(start, sizeof(Channel) * MIDI_NUM_CHANNELS * 2);
+    }
+    return same;
+}
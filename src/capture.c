@@ -0,0 +1,208 @@
+/*
+    Packet capture log
+
+    With CAPTURE the mapper records what it sees into a compact binary
+    log: every packet taken from an input link, every write to an output
+    link, the cluster name of each link as it is opened and each setup
+    swap. REPLAY reads a log back through the same remapping and compares
+    the output with what was recorded, see replayCapture().
+
+    Records go into a buffer allocated when the log is opened. The mapper
+    calls flushCapture() once its output for a drain cycle has been sent,
+    and the buffer is only written out there, once it is half full. The
+    only write on the way through is for a record that does not fit.
+
+    All values are stored big endian.
+
+        header      "MMCL", version, flags, E-clock rate of the recording
+        record      E-clock stamp (low word), kind, link, packet type,
+                    length (32 bits from version 2 on), then length bytes
+*/
+
+#include "midimapper.h"
+#include <string.h>
+
+#define CAPTURE_VERSION 2
+#define CAPTURE_HEADER  12
+#define CAPTURE_BUFFER  32768
+
+bool          capturing = false;
+
+static FILE*  capFile   = 0;
+static uint8* capBuffer = 0;
+static uint32 capLen    = 0;
+static uint32 capWritten;
+static bool   capError;
+
+/**************************************************************************/
+
+static void putLongAt(uint8* p, uint32 v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32 getLongAt(const uint8* p) {
+    return ((uint32)p[0] << 24) | ((uint32)p[1] << 16) | ((uint32)p[2] << 8) | p[3];
+}
+
+static void writeCapture(const uint8* data, uint32 len) {
+    if (len && !capError && fwrite(data, 1, len, capFile) != len) {
+        puts("*** unable to write the capture log, capture stopped");
+        capError = true;
+    }
+    capWritten += len;
+}
+
+/**************************************************************************/
+
+bool openCapture(const char* fName, uint32 flags) {
+    /* starts a log, flags are CAPTURE_ bits describing the recording */
+    uint8 header[CAPTURE_HEADER];
+    if (!(capBuffer = (uint8*)AllocMem(CAPTURE_BUFFER, MEMF_PUBLIC))) {
+        puts("*** unable to allocate capture buffer");
+        return false;
+    }
+    if (!(capFile = fopen(fName, "wb"))) {
+        printf("*** unable to create %s\n", fName);
+        FreeMem(capBuffer, CAPTURE_BUFFER);
+        capBuffer = 0;
+        return false;
+    }
+    memcpy(header, "MMCL", 4);
+    header[4] = CAPTURE_VERSION;
+    header[5] = 0;
+    header[6] = flags >> 8;
+    header[7] = flags;
+    putLongAt(header + 8, stampRate());
+    capLen     = 0;
+    capWritten = 0;
+    capError   = false;
+    capturing  = true;
+    writeCapture(header, CAPTURE_HEADER);
+    return true;
+}
+
+/**************************************************************************/
+
+void captureRecord(sint32 kind, sint32 link, sint32 type, const uint8* data, sint32 len) {
+    /* appends a record, stamped now */
+    uint8* p;
+    if (capLen + CAPTURE_RECORD + len > CAPTURE_BUFFER) {
+        writeCapture(capBuffer, capLen);
+        capLen = 0;
+    }
+    p = capBuffer + capLen;
+    putLongAt(p, readStamp());
+    p[4] = kind;
+    p[5] = link;
+    p[6] = type >> 8;
+    p[7] = type;
+    putLongAt(p + 8, len);
+    if (CAPTURE_RECORD + len > CAPTURE_BUFFER) {
+        /* a bulk dump bigger than the whole buffer goes straight out */
+        writeCapture(p, CAPTURE_RECORD);
+        writeCapture(data, len);
+        return;
+    }
+    if (len) {
+        memcpy(p + CAPTURE_RECORD, data, len);
+    }
+    capLen += CAPTURE_RECORD + len;
+}
+
+void flushCapture(void) {
+    /* call once output has been sent, writes the buffer once half full */
+    if (capLen >= CAPTURE_BUFFER / 2) {
+        writeCapture(capBuffer, capLen);
+        capLen = 0;
+    }
+}
+
+/**************************************************************************/
+
+void closeCapture(void) {
+    if (!capturing) {
+        return;
+    }
+    writeCapture(capBuffer, capLen);
+    fclose(capFile);
+    FreeMem(capBuffer, CAPTURE_BUFFER);
+    printf("captured %lu bytes\n", (unsigned long)capWritten);
+    capFile   = 0;
+    capBuffer = 0;
+    capLen    = 0;
+    capturing = false;
+}
+
+/**************************************************************************/
+
+bool openReplay(CaptureReader* cr, const char* fName) {
+    /* opens a log for reading, fills in the flags and rate of the recording */
+    uint8 header[CAPTURE_HEADER];
+    cr->size = 0;
+    cr->data = 0;
+    if (!(cr->file = fopen(fName, "rb"))) {
+        printf("*** unable to open %s\n", fName);
+        return false;
+    }
+    if (fread(header, 1, CAPTURE_HEADER, cr->file) != CAPTURE_HEADER || memcmp(header, "MMCL", 4)) {
+        printf("*** %s is not a capture log\n", fName);
+        fclose(cr->file);
+        return false;
+    }
+    if (header[4] != CAPTURE_VERSION) {
+        printf("*** %s is capture log version %d, not %d\n", fName, header[4], CAPTURE_VERSION);
+        fclose(cr->file);
+        return false;
+    }
+    cr->flags = (header[6] << 8) | header[7];
+    cr->rate  = getLongAt(header + 8);
+    return true;
+}
+
+/**************************************************************************/
+
+sint32 nextRecord(CaptureReader* cr) {
+    /* reads the next record, returns its kind, 0 at the end, -1 if damaged */
+    uint8 p[CAPTURE_RECORD];
+    sint32 n = fread(p, 1, CAPTURE_RECORD, cr->file);
+    if (n != CAPTURE_RECORD) {
+        return n ? -1 : 0;
+    }
+    cr->stamp = getLongAt(p);
+    cr->kind  = p[4];
+    cr->link  = p[5];
+    cr->type  = (p[6] << 8) | p[7];
+    cr->len   = getLongAt(p + 8);
+    if (cr->len > CAPTURE_MAX_RECORD) {
+        /* no packet or output write is that long */
+        return -1;
+    }
+    if (cr->len > cr->size) {
+        /* a buffer for the longest record so far */
+        if (cr->data) {
+            FreeMem(cr->data, cr->size);
+        }
+        cr->size = (cr->len + 255) & ~255;
+        if (!(cr->data = (uint8*)AllocMem(cr->size, MEMF_PUBLIC))) {
+            cr->size = 0;
+            return -1;
+        }
+    }
+    if (fread(cr->data, 1, cr->len, cr->file) != cr->len) {
+        return -1;
+    }
+    return cr->kind;
+}
+
+/**************************************************************************/
+
+void closeReplay(CaptureReader* cr) {
+    if (cr->data) {
+        FreeMem(cr->data, cr->size);
+        cr->data = 0;
+    }
+    fclose(cr->file);
+}
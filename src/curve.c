@@ -0,0 +1,242 @@
+/*
+    Curve tables
+
+    Builds the 128 entries of a curve: table from its parameters, using
+    only integer arithmetic. Without an FPU every pow() at load time went
+    through soft float; a config with a curve for each velocity and
+    controller map paid for that on every load and reload.
+
+    Values are 16.16 fixed point unless noted. Logarithms and powers of two
+    keep a 1.31 mantissa, multiplied with the 32 x 32 bit high product
+    built from 16 bit halves, which 68000 code can do without a library.
+    The power law comes out within 1 of the floating point version it
+    replaces, and is usually identical.
+
+    Kinds:
+
+        power   y = zeroY + yScale * (grad * (x - zeroX) / 128) ^ power,
+                mirrored for x below zeroX, then clamped to min..max
+        points  straight lines between breakpoints
+        spline  a smooth curve through the points (Catmull-Rom: cubic
+                Hermite segments with the slope at each point taken from
+                its neighbours)
+        exp     from 0 to 127 through a knee point below the diagonal,
+                y = 127 * (2^(k t) - 1) / (2^k - 1) with t = x / 127
+        log     its mirror image, through a knee point above the diagonal
+
+    For points and spline, inputs before the first point and after the last
+    keep the end values.
+*/
+
+#include "midimapper.h"
+
+#define FIX_HUGE    0x7FFFFFF                     /* stands in for infinity */
+#define KNEE_MAX    (14 * FIX_ONE)                /* steepest exp/log curve */
+
+/* 2^(2^-k) for k = 1..16, 1.31 */
+static const uint32 expBit[16] = {
+    3037000500UL, 2553802834UL, 2341847524UL, 2242560872UL,
+    2194507417UL, 2170868212UL, 2159144272UL, 2153306067UL,
+    2150392887UL, 2148937775UL, 2148210589UL, 2147847087UL,
+    2147665360UL, 2147574502UL, 2147529075UL, 2147506361UL
+};
+
+/**************************************************************************/
+
+static uint32 mulHigh(uint32 a, uint32 b) {
+    /* top 32 bits of the 64 bit product */
+    uint32 al = a & 0xFFFF, ah = a >> 16;
+    uint32 bl = b & 0xFFFF, bh = b >> 16;
+    uint32 lo = al * bl, m1 = ah * bl, m2 = al * bh;
+    uint32 carry = ((lo >> 16) + (m1 & 0xFFFF) + (m2 & 0xFFFF)) >> 16;
+    return ah * bh + (m1 >> 16) + (m2 >> 16) + carry;
+}
+
+static uint32 fixMul(uint32 a, uint32 b) {
+    /* unsigned, the result must fit */
+    return (mulHigh(a, b) << 16) | ((a * b) >> 16);
+}
+
+static sint32 fixMulSigned(sint32 a, sint32 b) {
+    /* saturates at +-FIX_HUGE */
+    uint32 ua = a < 0 ? -a : a;
+    uint32 ub = b < 0 ? -b : b;
+    uint32 r  = mulHigh(ua, ub) >= (FIX_HUGE >> 16) ? FIX_HUGE : fixMul(ua, ub);
+    return (a < 0) != (b < 0) ? -(sint32)r : (sint32)r;
+}
+
+static uint32 fixRatio(uint32 a, uint32 b) {
+    /* a / b for 0 <= a <= b < 2^31, by long division */
+    uint32 q = 0;
+    sint32 i;
+    for (i = 0; i < 17; i++) {
+        q <<= 1;
+        if (a >= b) {
+            a -= b;
+            q |= 1;
+        }
+        a <<= 1;
+    }
+    return q;
+}
+
+/**************************************************************************/
+
+static sint32 fixLog2(uint32 v, sint32 fracBits) {
+    /* log2 of v / 2^fracBits, v > 0 */
+    sint32 n = 31;
+    sint32 r;
+    uint32 b;
+    while (!(v & 0x80000000UL)) {
+        v <<= 1;
+        n--;
+    }
+    r = (n - fracBits) * FIX_ONE;
+    /* the mantissa is squared once per bit of the result */
+    for (b = FIX_ONE >> 1; b; b >>= 1) {
+        v = mulHigh(v, v);
+        if (v & 0x80000000UL) {
+            r |= b;
+        }
+        else {
+            v <<= 1;
+        }
+    }
+    return r;
+}
+
+static uint32 fixExp2(sint32 e) {
+    /* 2^e, saturating at 0xFFFFFFFF */
+    uint32 f = (uint32)e & 0xFFFF;
+    sint32 i = (e - (sint32)f) / FIX_ONE;
+    sint32 shift = 15 - i;
+    uint32 r = 0x80000000UL;
+    sint32 k;
+    if (i > 15) {
+        return 0xFFFFFFFFUL;
+    }
+    if (shift > 31) {
+        return 0;
+    }
+    for (k = 0; k < 16; k++) {
+        if (f & (0x8000 >> k)) {
+            r = mulHigh(r, expBit[k]) << 1;
+        }
+    }
+    return shift ? (r >> shift) + ((r >> (shift - 1)) & 1) : r;
+}
+
+/**************************************************************************/
+
+void powerCurve(uint8* data, sint32 min, sint32 max, sint32 zeroX, sint32 zeroY, sint32 grad, sint32 power) {
+    /* the original curve: kind; grad and power are 16.16 */
+    sint32 yScale = max - min;
+    uint32 scale  = yScale < 0 ? -yScale : yScale;
+    sint32 gLog   = grad ? fixLog2(grad < 0 ? -grad : grad, 16) - 7 * FIX_ONE : 0;
+    bool   flip   = grad < 0 && (power & 0x1FFFF) == FIX_ONE; /* odd whole power of a negative */
+    sint32 i;
+    scale = scale > 0xFFFF ? 0xFFFF : scale;
+    for (i = 0; i < MIDI_TABLE_SIZE; i++) {
+        sint32 x = i - zeroX;
+        uint32 p, mag;
+        sint32 y;
+        if (!x || !grad) {
+            /* 0 to a power */
+            p = power > 0 ? 0 : power ? 0xFFFFFFFFUL : FIX_ONE;
+        }
+        else {
+            p = fixExp2(fixMulSigned(power, gLog + fixLog2(x < 0 ? -x : x, 0)));
+        }
+        mag = p == 0xFFFFFFFFUL ? FIX_HUGE : mulHigh(scale << 16, p);
+        mag = mag > FIX_HUGE ? FIX_HUGE : mag;
+        /* the sign of each factor, then truncated towards zero */
+        y = ((x < 0) != (yScale < 0)) != flip ? -(sint32)mag : (sint32)mag;
+        y += zeroY;
+        data[i] = y > max ? max : y < min ? min : y;
+    }
+}
+
+/**************************************************************************/
+
+static sint32 clampValue(sint32 y) {
+    return y < 0 ? 0 : y > 127 ? 127 : y;
+}
+
+void pointCurve(uint8* data, const uint8* x, const uint8* y, sint32 n, bool spline) {
+    /* points or spline: through n >= 2 points with x rising */
+    sint32 i, j = 0;
+    for (i = 0; i < MIDI_TABLE_SIZE; i++) {
+        sint32 h, dx, dy;
+        if (i <= x[0] || i >= x[n - 1]) {
+            data[i] = i <= x[0] ? y[0] : y[n - 1];
+            continue;
+        }
+        while (i > x[j + 1]) {
+            j++;
+        }
+        h  = x[j + 1] - x[j];
+        dx = i - x[j];
+        dy = y[j + 1] - y[j];
+        if (!spline) {
+            /* rounded to the nearest, halves away from zero */
+            sint32 v = dy * dx * 2;
+            data[i] = y[j] + (v < 0 ? (v - h) / (2 * h) : (v + h) / (2 * h));
+        }
+        else {
+            /* slopes scaled to the segment, 8 fraction bits */
+            sint32 d0 = j ? h * (y[j + 1] - y[j - 1]) * 256 / (x[j + 1] - x[j - 1]) : dy * 256;
+            sint32 d1 = j + 2 < n ? h * (y[j + 2] - y[j]) * 256 / (x[j + 2] - x[j]) : dy * 256;
+            /* Hermite basis at t = dx / h, 12 fraction bits */
+            sint32 t  = (dx << 12) / h;
+            sint32 t2 = (t * t) >> 12;
+            sint32 t3 = (t2 * t) >> 12;
+            sint32 v  = (2 * t3 - 3 * t2 + 4096) * (y[j] << 8) + (t3 - 2 * t2 + t) * d0 +
+                        (3 * t2 - 2 * t3) * (y[j + 1] << 8) + (t3 - t2) * d1;
+            data[i] = v < 0 ? 0 : clampValue((((v + 2048) >> 12) + 128) >> 8);
+        }
+    }
+}
+
+/**************************************************************************/
+
+static uint32 expAt(uint32 k, uint32 t) {
+    /* (2^(k t) - 1) / (2^k - 1), t = 0..1 */
+    return fixRatio(fixExp2(fixMul(k, t)) - FIX_ONE, fixExp2(k) - FIX_ONE);
+}
+
+static uint32 logAt(uint32 k, uint32 t) {
+    /* the inverse of expAt() */
+    return fixRatio(fixLog2(FIX_ONE + fixMul(fixExp2(k) - FIX_ONE, t), 16), k);
+}
+
+bool kneeCurve(uint8* data, sint32 kneeX, sint32 kneeY, bool log) {
+    /* exp or log: 0 to 127 through the knee, 0 < knee < 127; false if too sharp */
+    uint32 lo = 0, hi = KNEE_MAX, k;
+    uint32 tx = ((uint32)(log ? kneeY : kneeX) << 16) / 127;
+    uint32 ty = ((uint32)(log ? kneeX : kneeY) << 16) / 127;
+    sint32 i;
+    if (kneeX == kneeY) {
+        for (i = 0; i < MIDI_TABLE_SIZE; i++) {
+            data[i] = i;
+        }
+        return true;
+    }
+    /* the exp curve through tx:ty gets flatter as k falls */
+    while (hi - lo > 1) {
+        k = (lo + hi) >> 1;
+        if (expAt(k, tx) > ty) {
+            lo = k;
+        }
+        else {
+            hi = k;
+        }
+    }
+    if ((k = hi) == KNEE_MAX) {
+        return false;
+    }
+    for (i = 0; i < MIDI_TABLE_SIZE; i++) {
+        uint32 t = ((uint32)i << 16) / 127;
+        data[i] = clampValue((sint32)(((log ? logAt(k, t) : expAt(k, t)) * 127 + 0x8000) >> 16));
+    }
+    return true;
+}
@@ -0,0 +1,23 @@
+/*
+    Host stand-in for devices/timer.h
+*/
+
+#ifndef _HOST_DEVICES_TIMER_H
+#define _HOST_DEVICES_TIMER_H
+#include <proto/exec.h>
+
+#define TIMERNAME    "timer.device"
+#define UNIT_MICROHZ 0
+#define UNIT_VBLANK  1
+#define UNIT_ECLOCK  2
+
+struct EClockVal {
+    ULONG ev_hi;
+    ULONG ev_lo;
+};
+
+struct timerequest {
+    struct IORequest tr_node;
+};
+
+#endif
@@ -0,0 +1,15 @@
+/*
+    Host stand-in for dos/dostags.h
+*/
+
+#ifndef _HOST_DOS_DOSTAGS_H
+#define _HOST_DOS_DOSTAGS_H
+
+#define TAG_DONE    0UL
+#define TAG_USER    (1UL<<31)
+#define NP_Dummy    (TAG_USER + 1000)
+#define NP_Entry    (NP_Dummy + 3)
+#define NP_Name     (NP_Dummy + 11)
+#define NP_Priority (NP_Dummy + 12)
+
+#endif
@@ -0,0 +1,604 @@
+/*
+    Host stand-in for exec.library and midi.library
+
+    Just enough of both to run the mapper unchanged on a POSIX host. MIDI
+    input is read from files or pipes and framed into packets the way the
+    library does it (running status expanded, realtime bytes as their own
+    packets, SysEx gathered into a single packet). Output streams are
+    written out verbatim.
+*/
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <proto/exec.h>
+#include <proto/dos.h>
+#include <proto/midi.h>
+#include <proto/timer.h>
+#include <dos/dostags.h>
+
+#define HOST_READ_BUFFER 4096
+#define HOST_MAX_ROUTES  32
+
+struct MRoute {
+    struct MSource* source;
+    struct MDest*   dest;
+    FILE*           out;
+    int             fd;
+    int             eof;
+    /* input framing state */
+    UBYTE           status;
+    UBYTE           need;
+    UBYTE           have;
+    UBYTE           data[3];
+    UBYTE*          sysex;
+    ULONG           sysexLen;
+    ULONG           sysexMax;
+};
+
+static struct Library   midiLib      = { MIDINAME, 2 };
+static struct Task      mainTask     = { "midimapper", 0, 0 };
+static __thread struct Task* thisTask = &mainTask;
+static struct MRoute*   routes[HOST_MAX_ROUTES];
+static ULONG            usedSigBits  = 0x0000FFFF; /* system bits */
+static pthread_mutex_t  sigLock      = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   sigCond      = PTHREAD_COND_INITIALIZER;
+static int              wakePipe[2]  = { -1, -1 };
+static volatile sig_atomic_t gotBreak = 0;
+static volatile sig_atomic_t gotHangup = 0;
+static volatile sig_atomic_t gotInfo   = 0;
+static struct Device    timerDevice  = { TIMERNAME };
+
+/**************************************************************************/
+
+static void onBreak(int sig) {
+    /* SIGINT is CTRL-C, SIGHUP is CTRL-D, SIGUSR1 is CTRL-E */
+    if (sig == SIGHUP) {
+        gotHangup = 1;
+    }
+    else if (sig == SIGUSR1) {
+        gotInfo = 1;
+    }
+    else {
+        gotBreak = 1;
+    }
+    if (wakePipe[1] >= 0) {
+        (void)write(wakePipe[1], "", 1);
+    }
+}
+
+static void hostInit(void) {
+    static int done = 0;
+    if (!done) {
+        done = 1;
+        if (pipe(wakePipe) == 0) {
+            fcntl(wakePipe[0], F_SETFL, O_NONBLOCK);
+            fcntl(wakePipe[1], F_SETFL, O_NONBLOCK);
+        }
+        signal(SIGINT, onBreak);
+        signal(SIGHUP, onBreak);
+        signal(SIGUSR1, onBreak);
+    }
+}
+
+/**************************************************************************/
+
+APTR AllocMem(ULONG size, ULONG flags) {
+    return (flags & MEMF_CLEAR) ? calloc(1, size) : malloc(size);
+}
+
+void FreeMem(APTR mem, ULONG size) {
+    free(mem);
+}
+
+struct Library* OpenLibrary(const char* name, ULONG version) {
+    hostInit();
+    if (strcmp(name, MIDINAME) == 0 && version <= midiLib.lib_Version) {
+        return &midiLib;
+    }
+    return 0;
+}
+
+void CloseLibrary(struct Library* lib) {
+}
+
+struct Task* FindTask(const char* name) {
+    return thisTask;
+}
+
+LONG SetTaskPri(struct Task* task, LONG pri) {
+    LONG old = task->tc_Pri;
+    task->tc_Pri = (BYTE)pri;
+    return old;
+}
+
+/**************************************************************************/
+
+void Signal(struct Task* task, ULONG signals) {
+    pthread_mutex_lock(&sigLock);
+    task->tc_SigRecvd |= signals;
+    pthread_cond_broadcast(&sigCond);
+    pthread_mutex_unlock(&sigLock);
+    if (task == &mainTask && wakePipe[1] >= 0) {
+        (void)write(wakePipe[1], "", 1);
+    }
+}
+
+static ULONG allocSigBit(void) {
+    ULONG bit;
+    pthread_mutex_lock(&sigLock);
+    for (bit = 16; bit < 32; bit++) {
+        if (!(usedSigBits & (1UL << bit))) {
+            usedSigBits |= 1UL << bit;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sigLock);
+    return bit < 32 ? bit : 31;
+}
+
+BYTE AllocSignal(LONG signalNum) {
+    return (BYTE)allocSigBit();
+}
+
+void FreeSignal(LONG signalNum) {
+    if (signalNum >= 16) {
+        pthread_mutex_lock(&sigLock);
+        usedSigBits &= ~(1UL << signalNum);
+        pthread_mutex_unlock(&sigLock);
+    }
+}
+
+BYTE OpenDevice(const char* name, ULONG unit, struct IORequest* io, ULONG flags) {
+    /* only timer.device is known */
+    if (strcmp(name, TIMERNAME) != 0) {
+        return io->io_Error = -1;
+    }
+    io->io_Device = &timerDevice;
+    return io->io_Error = 0;
+}
+
+void CloseDevice(struct IORequest* io) {
+    io->io_Device = 0;
+}
+
+ULONG ReadEClock(struct EClockVal* dest) {
+    struct timespec ts;
+    uint64_t        us;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    dest->ev_hi = (ULONG)(us >> 32);
+    dest->ev_lo = (ULONG)us;
+    return 1000000;
+}
+
+void Delay(LONG ticks) {
+    struct timespec ts;
+    ts.tv_sec  = ticks / 50;
+    ts.tv_nsec = (ticks % 50) * 20000000L;
+    nanosleep(&ts, 0);
+}
+
+void Forbid(void) {
+}
+
+void Permit(void) {
+}
+
+/**************************************************************************/
+
+typedef struct {
+    struct Process proc;
+    void           (*entry)(void);
+} HostProcess;
+
+static void* processMain(void* arg) {
+    HostProcess* p = (HostProcess*)arg;
+    thisTask = &p->proc.pr_Task;
+    p->entry();
+    free(p);
+    return 0;
+}
+
+struct Process* CreateNewProcTags(ULONG tag, ...) {
+    /*
+        Only NP_Entry, NP_Name and NP_Priority are understood. Tag data is
+        read as unsigned long, which is pointer sized on the host just as
+        ULONG is on the Amiga.
+    */
+    HostProcess*  p = (HostProcess*)calloc(1, sizeof(HostProcess));
+    unsigned long t = tag;
+    pthread_t     thread;
+    va_list       tags;
+    if (!p) {
+        return 0;
+    }
+    va_start(tags, tag);
+    while (t != TAG_DONE) {
+        unsigned long data = va_arg(tags, unsigned long);
+        switch (t) {
+            case NP_Entry:    p->entry = (void (*)(void))data; break;
+            case NP_Name:     p->proc.pr_Task.tc_Name = (const char*)data; break;
+            case NP_Priority: p->proc.pr_Task.tc_Pri = (BYTE)data; break;
+        }
+        t = va_arg(tags, unsigned long);
+    }
+    va_end(tags);
+    if (!p->entry || pthread_create(&thread, 0, processMain, p) != 0) {
+        free(p);
+        return 0;
+    }
+    pthread_detach(thread);
+    return &p->proc;
+}
+
+/**************************************************************************/
+
+static UWORD packetType(const UBYTE* msg) {
+    switch (msg[0] & 0xF0) {
+        case MS_NOTEOFF:    return MMF_NOTEOFF;
+        case MS_NOTEON:     return MMF_NOTEON;
+        case MS_POLYPRESS:  return MMF_POLYPRESS;
+        case MS_CTRL:       return msg[1] >= 120 ? MMF_MODE : MMF_CTRL;
+        case MS_PROG:       return MMF_PROG;
+        case MS_CHANPRESS:  return MMF_CHANPRESS;
+        case MS_PITCHBEND:  return MMF_PITCHBEND;
+    }
+    if (msg[0] == MS_SYSEX) {
+        return MMF_SYSEX;
+    }
+    return msg[0] >= MS_CLOCK ? MMF_REALTIME : MMF_SYSCOM;
+}
+
+static void queuePacket(struct MDest* dest, const UBYTE* msg, ULONG len) {
+    ULONG extra = len > 4 ? len - 4 : 0;
+    struct MidiPacket* p = (struct MidiPacket*)malloc(sizeof(struct MidiPacket) + extra);
+    if (p) {
+        p->next     = 0;
+        p->Length   = (UWORD)len;
+        p->reserved = 0;
+        memcpy(p->MidiMsg, msg, len);
+        p->Type     = packetType(p->MidiMsg);
+        if (dest->tail) {
+            dest->tail->next = p;
+        }
+        else {
+            dest->head = p;
+        }
+        dest->tail = p;
+    }
+}
+
+static void sysexByte(struct MRoute* r, UBYTE b) {
+    if (r->sysexLen == r->sysexMax) {
+        ULONG  max = r->sysexMax ? r->sysexMax * 2 : 256;
+        UBYTE* buf = (UBYTE*)realloc(r->sysex, max);
+        if (!buf) {
+            return;
+        }
+        r->sysex    = buf;
+        r->sysexMax = max;
+    }
+    r->sysex[r->sysexLen++] = b;
+}
+
+static ULONG dataLength(UBYTE status) {
+    if (status < 0xF0) {
+        return ((status & 0xE0) == 0xC0) ? 1 : 2;
+    }
+    switch (status) {
+        case MS_QTRFRAME:
+        case MS_SONGSELECT: return 1;
+        case MS_SONGPOS:    return 2;
+    }
+    return 0;
+}
+
+static void frameBytes(struct MRoute* r, const UBYTE* buf, ULONG len) {
+    /* splits a raw byte run into packets */
+    struct MDest* dest = r->dest;
+    while (len--) {
+        UBYTE b = *buf++;
+        if (b >= MS_CLOCK) {
+            /* realtime, may appear anywhere */
+            queuePacket(dest, &b, 1);
+        }
+        else if (b & 0x80) {
+            if (r->status == MS_SYSEX) {
+                sysexByte(r, MS_EOX);
+                queuePacket(dest, r->sysex, r->sysexLen);
+                r->status = 0;
+                if (b == MS_EOX) {
+                    continue;
+                }
+            }
+            if (b == MS_SYSEX) {
+                r->status   = MS_SYSEX;
+                r->sysexLen = 0;
+                sysexByte(r, b);
+                continue;
+            }
+            r->data[0] = b;
+            r->have    = 1;
+            r->need    = (UBYTE)dataLength(b);
+            /* system common cancels running status */
+            r->status  = b < 0xF0 ? b : 0;
+            if (!r->need && b >= 0xF0) {
+                if (b != MS_EOX) {
+                    queuePacket(dest, r->data, 1);
+                }
+                r->have = 0;
+            }
+        }
+        else if (r->status == MS_SYSEX) {
+            sysexByte(r, b);
+        }
+        else if (r->have) {
+            r->data[r->have++] = b;
+            if (r->have > r->need) {
+                queuePacket(dest, r->data, r->have);
+                r->have = r->status ? 1 : 0;
+            }
+        }
+        else if (r->status) {
+            /* running status */
+            r->data[0] = r->status;
+            r->data[1] = b;
+            r->have    = 2;
+            if (r->have > r->need) {
+                queuePacket(dest, r->data, r->have);
+                r->have = 1;
+            }
+        }
+    }
+}
+
+/**************************************************************************/
+
+static struct MRoute* newRoute(void) {
+    int i;
+    for (i = 0; i < HOST_MAX_ROUTES; i++) {
+        if (!routes[i]) {
+            struct MRoute* r = (struct MRoute*)calloc(1, sizeof(struct MRoute));
+            if (r) {
+                r->fd     = -1;
+                routes[i] = r;
+            }
+            return r;
+        }
+    }
+    return 0;
+}
+
+struct MDest* CreateMDest(const char* name, struct Image* image) {
+    struct MDest* dest = (struct MDest*)calloc(1, sizeof(struct MDest));
+    if (dest) {
+        dest->DestPort        = &dest->port;
+        dest->port.mp_SigBit  = (UBYTE)allocSigBit();
+    }
+    return dest;
+}
+
+void DeleteMDest(struct MDest* dest) {
+    if (dest) {
+        struct MidiPacket* p;
+        while ((p = GetMidiPacket(dest))) {
+            FreeMidiPacket(p);
+        }
+        FreeSignal(dest->port.mp_SigBit);
+        free(dest);
+    }
+}
+
+struct MSource* CreateMSource(const char* name, struct Image* image) {
+    return (struct MSource*)calloc(1, sizeof(struct MSource));
+}
+
+void DeleteMSource(struct MSource* source) {
+    free(source);
+}
+
+struct MRoute* MRouteDest(const char* cluster, struct MDest* dest, struct MRouteInfo* info) {
+    const char*    path = getenv(cluster);
+    struct MRoute* r;
+    int            fd;
+    if (!path || strcmp(path, "-") == 0) {
+        fd = dup(0);
+    }
+    else if ((fd = open(path, O_RDONLY)) < 0) {
+        fprintf(stderr, "*** %s: unable to open %s\n", cluster, path);
+        return 0;
+    }
+    if (!(r = newRoute())) {
+        close(fd);
+        return 0;
+    }
+    r->dest    = dest;
+    r->fd      = fd;
+    dest->route = r;
+    return r;
+}
+
+struct MRoute* MRouteSource(struct MSource* source, const char* cluster, struct MRouteInfo* info) {
+    const char*    path = getenv(cluster);
+    struct MRoute* r;
+    FILE*          out = 0;
+    if (path) {
+        if (strcmp(path, "-") == 0) {
+            out = stdout;
+        }
+        else if (!(out = fopen(path, "wb"))) {
+            fprintf(stderr, "*** %s: unable to open %s\n", cluster, path);
+            return 0;
+        }
+    }
+    if (!(r = newRoute())) {
+        if (out && out != stdout) {
+            fclose(out);
+        }
+        return 0;
+    }
+    r->source     = source;
+    r->out        = out;
+    source->route = r;
+    return r;
+}
+
+void DeleteMRoute(struct MRoute* route) {
+    int i;
+    if (!route) {
+        return;
+    }
+    for (i = 0; i < HOST_MAX_ROUTES; i++) {
+        if (routes[i] == route) {
+            routes[i] = 0;
+        }
+    }
+    if (route->dest) {
+        route->dest->route = 0;
+    }
+    if (route->source) {
+        route->source->route = 0;
+    }
+    if (route->fd >= 0) {
+        close(route->fd);
+    }
+    if (route->out) {
+        fflush(route->out);
+        if (route->out != stdout) {
+            fclose(route->out);
+        }
+    }
+    free(route->sysex);
+    free(route);
+}
+
+/**************************************************************************/
+
+struct MidiPacket* GetMidiPacket(struct MDest* dest) {
+    struct MidiPacket* p = dest->head;
+    if (p) {
+        if (!(dest->head = p->next)) {
+            dest->tail = 0;
+        }
+    }
+    return p;
+}
+
+void FreeMidiPacket(struct MidiPacket* packet) {
+    free(packet);
+}
+
+void PutMidiStream(struct MSource* source, ULONG (*fill)(void), UBYTE* buf, ULONG size, ULONG count) {
+    struct MRoute* r = source->route;
+    do {
+        if (r && r->out && count) {
+            fwrite(buf, 1, count, r->out);
+        }
+    } while (fill && (count = fill()));
+}
+
+/**************************************************************************/
+
+static ULONG takeSignals(struct Task* task, ULONG signals) {
+    /* call with sigLock held */
+    ULONG got = task->tc_SigRecvd & signals;
+    task->tc_SigRecvd &= ~got;
+    return got;
+}
+
+ULONG Wait(ULONG signals) {
+    /*
+        Blocks until one of the requested signals is set. For the main task
+        routed inputs are polled and framed while waiting; a dest is
+        signalled as soon as it has packets queued. When every input has
+        hit end of file, CTRL-C is raised so the mapper shuts down as if the
+        user had broken it. Other tasks simply sleep until signalled.
+    */
+    UBYTE buffer[HOST_READ_BUFFER];
+    if (thisTask != &mainTask) {
+        ULONG got;
+        pthread_mutex_lock(&sigLock);
+        while (!(got = takeSignals(thisTask, signals))) {
+            pthread_cond_wait(&sigCond, &sigLock);
+        }
+        pthread_mutex_unlock(&sigLock);
+        return got;
+    }
+    for (;;) {
+        struct pollfd  fds[HOST_MAX_ROUTES + 1];
+        struct MRoute* polled[HOST_MAX_ROUTES + 1];
+        ULONG          got;
+        int            i, n = 0, open = 0;
+
+        pthread_mutex_lock(&sigLock);
+        if (gotBreak) {
+            gotBreak = 0;
+            mainTask.tc_SigRecvd |= SIGBREAKF_CTRL_C;
+        }
+        if (gotHangup) {
+            gotHangup = 0;
+            mainTask.tc_SigRecvd |= SIGBREAKF_CTRL_D;
+        }
+        if (gotInfo) {
+            gotInfo = 0;
+            mainTask.tc_SigRecvd |= SIGBREAKF_CTRL_E;
+        }
+        got = takeSignals(&mainTask, signals);
+        pthread_mutex_unlock(&sigLock);
+        if (got) {
+            return got;
+        }
+        fds[n].fd     = wakePipe[0];
+        fds[n].events = POLLIN;
+        polled[n++]   = 0;
+        for (i = 0; i < HOST_MAX_ROUTES; i++) {
+            struct MRoute* r = routes[i];
+            if (r && r->dest && r->fd >= 0 && !r->eof) {
+                open++;
+                if (signals & (1UL << r->dest->port.mp_SigBit)) {
+                    fds[n].fd     = r->fd;
+                    fds[n].events = POLLIN;
+                    polled[n++]   = r;
+                }
+            }
+        }
+        if (!open) {
+            Signal(&mainTask, SIGBREAKF_CTRL_C);
+            continue;
+        }
+        if (poll(fds, n, -1) < 0) {
+            if (errno != EINTR) {
+                Signal(&mainTask, SIGBREAKF_CTRL_C);
+            }
+            continue;
+        }
+        if (fds[0].revents & POLLIN) {
+            while (read(wakePipe[0], buffer, sizeof(buffer)) > 0) {
+            }
+        }
+        for (i = 1; i < n; i++) {
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                struct MRoute* r   = polled[i];
+                ssize_t        len = read(r->fd, buffer, sizeof(buffer));
+                if (len > 0) {
+                    frameBytes(r, buffer, (ULONG)len);
+                    if (r->dest->head) {
+                        Signal(&mainTask, 1UL << r->dest->port.mp_SigBit);
+                    }
+                }
+                else if (len == 0 || errno != EINTR) {
+                    r->eof = 1;
+                }
+            }
+        }
+    }
+}
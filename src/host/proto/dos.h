@@ -0,0 +1,25 @@
+/*
+    Host stand-in for the dos.library subset used by the mapper
+*/
+
+#ifndef _HOST_PROTO_DOS_H
+#define _HOST_PROTO_DOS_H
+#include <proto/exec.h>
+
+struct Process {
+    struct Task pr_Task;
+};
+
+/* program return codes */
+#define RETURN_OK    0
+#define RETURN_WARN  5
+#define RETURN_ERROR 10
+#define RETURN_FAIL  20
+
+/* processes are started as threads */
+struct Process* CreateNewProcTags(ULONG tag, ...);
+
+/* sleeps for ticks of 1/50s */
+void Delay(LONG ticks);
+
+#endif
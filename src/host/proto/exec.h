@@ -0,0 +1,75 @@
+/*
+    Host stand-in for the exec.library subset used by the mapper
+*/
+
+#ifndef _HOST_PROTO_EXEC_H
+#define _HOST_PROTO_EXEC_H
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint8_t  UBYTE;
+typedef int8_t   BYTE;
+typedef uint16_t UWORD;
+typedef int16_t  WORD;
+typedef uint32_t ULONG;
+typedef int32_t  LONG;
+typedef void*    APTR;
+typedef char*    STRPTR;
+typedef int16_t  BOOL;
+
+#ifndef FALSE
+#define FALSE 0
+#endif
+#ifndef TRUE
+#define TRUE  1
+#endif
+
+#define MEMF_ANY    0L
+#define MEMF_PUBLIC (1L<<0)
+#define MEMF_CLEAR  (1L<<16)
+
+#define SIGBREAKF_CTRL_C (1L<<12)
+#define SIGBREAKF_CTRL_D (1L<<13)
+#define SIGBREAKF_CTRL_E (1L<<14)
+#define SIGBREAKF_CTRL_F (1L<<15)
+
+struct Library {
+    const char* lib_Name;
+    UWORD       lib_Version;
+};
+
+struct MsgPort {
+    UBYTE mp_SigBit;
+};
+
+struct Device {
+    const char* dd_Name;
+};
+
+struct IORequest {
+    struct Device* io_Device;
+    BYTE           io_Error;
+};
+
+struct Task {
+    const char*    tc_Name;
+    BYTE           tc_Pri;
+    volatile ULONG tc_SigRecvd;
+};
+
+APTR            AllocMem(ULONG size, ULONG flags);
+void            FreeMem(APTR mem, ULONG size);
+struct Library* OpenLibrary(const char* name, ULONG version);
+void            CloseLibrary(struct Library* lib);
+struct Task*    FindTask(const char* name);
+LONG            SetTaskPri(struct Task* task, LONG pri);
+ULONG           Wait(ULONG signals);
+void            Signal(struct Task* task, ULONG signals);
+BYTE            AllocSignal(LONG signalNum);
+void            FreeSignal(LONG signalNum);
+BYTE            OpenDevice(const char* name, ULONG unit, struct IORequest* io, ULONG flags);
+void            CloseDevice(struct IORequest* io);
+void            Forbid(void);
+void            Permit(void);
+
+#endif
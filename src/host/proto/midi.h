@@ -0,0 +1,88 @@
+/*
+    Host stand-in for midi.library
+
+    Clusters are mapped onto files: the environment variable named after
+    the cluster (e.g. MidiIn, MidiOut) gives the path to read or write,
+    "-" meaning stdin/stdout. If unset, MidiIn reads stdin and any other
+    cluster discards what is written to it.
+*/
+
+#ifndef _HOST_PROTO_MIDI_H
+#define _HOST_PROTO_MIDI_H
+#include <proto/exec.h>
+
+#define MIDINAME    "midi.library"
+#define MIDIVERSION 2L
+
+/* status bytes */
+#define MS_NOTEOFF    0x80
+#define MS_NOTEON     0x90
+#define MS_POLYPRESS  0xA0
+#define MS_CTRL       0xB0
+#define MS_MODE       0xB0
+#define MS_PROG       0xC0
+#define MS_CHANPRESS  0xD0
+#define MS_PITCHBEND  0xE0
+#define MS_SYSEX      0xF0
+#define MS_QTRFRAME   0xF1
+#define MS_SONGPOS    0xF2
+#define MS_SONGSELECT 0xF3
+#define MS_TUNEREQ    0xF6
+#define MS_EOX        0xF7
+#define MS_CLOCK      0xF8
+#define MS_START      0xFA
+#define MS_CONTINUE   0xFB
+#define MS_STOP       0xFC
+#define MS_ACTVSENSE  0xFE
+#define MS_RESET      0xFF
+
+/* packet types */
+#define MMF_NOTEOFF   0x0001
+#define MMF_NOTEON    0x0002
+#define MMF_POLYPRESS 0x0004
+#define MMF_CTRL      0x0008
+#define MMF_MODE      0x0010
+#define MMF_PROG      0x0020
+#define MMF_CHANPRESS 0x0040
+#define MMF_PITCHBEND 0x0080
+#define MMF_SYSEX     0x0100
+#define MMF_SYSCOM    0x0200
+#define MMF_REALTIME  0x0400
+#define MMF_ANY       0x07FF
+
+struct MidiPacket {
+    struct MidiPacket* next;
+    UWORD              Type;
+    UWORD              Length;
+    ULONG              reserved;
+    UBYTE              MidiMsg[4]; /* extended for sysex */
+};
+
+struct MDest {
+    struct MsgPort*    DestPort;
+    struct MsgPort     port;
+    struct MidiPacket* head;
+    struct MidiPacket* tail;
+    struct MRoute*     route;
+};
+
+struct MSource {
+    struct MRoute* route;
+};
+
+struct MRoute;
+struct MRouteInfo;
+struct Image;
+
+struct MDest*      CreateMDest(const char* name, struct Image* image);
+void               DeleteMDest(struct MDest* dest);
+struct MSource*    CreateMSource(const char* name, struct Image* image);
+void               DeleteMSource(struct MSource* source);
+struct MRoute*     MRouteDest(const char* cluster, struct MDest* dest, struct MRouteInfo* info);
+struct MRoute*     MRouteSource(struct MSource* source, const char* cluster, struct MRouteInfo* info);
+void               DeleteMRoute(struct MRoute* route);
+struct MidiPacket* GetMidiPacket(struct MDest* dest);
+void               FreeMidiPacket(struct MidiPacket* packet);
+void               PutMidiStream(struct MSource* source, ULONG (*fill)(void), UBYTE* buf, ULONG size, ULONG count);
+
+#endif
@@ -0,0 +1,14 @@
+/*
+    Host stand-in for the timer.device functions used by the mapper
+*/
+
+#ifndef _HOST_PROTO_TIMER_H
+#define _HOST_PROTO_TIMER_H
+#include <devices/timer.h>
+
+extern struct Device* TimerBase;
+
+/* monotonic clock in microseconds, returns the tick rate */
+ULONG ReadEClock(struct EClockVal* dest);
+
+#endif
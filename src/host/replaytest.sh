@@ -0,0 +1,47 @@
+#!/bin/sh
+#
+#   Replays a capture log of the host build, then damaged copies of it.
+#   Run from src/ by "make check".
+#
+
+MAPPER=host/midimapper
+CONFIG=../examples/NullRemap.cfg
+DIR=${TMPDIR:-/tmp}/replaytest.$$
+FAILED=0
+
+mkdir -p $DIR || exit 1
+trap 'rm -rf $DIR' 0
+
+# note on, note off, controller, program change
+printf '\220\074\100\200\074\000\260\007\144\300\005' > $DIR/in.raw
+MidiIn=$DIR/in.raw MidiOut=/dev/null $MAPPER $CONFIG CAPTURE $DIR/good.log > /dev/null
+if [ ! -s $DIR/good.log ]; then
+    echo "FAIL: capture"
+    exit 1
+fi
+
+replay() {
+    # replay <log> <expected return code> <expected message> <what>
+    $MAPPER $CONFIG REPLAY $1 > $DIR/out.txt 2>&1
+    rc=$?
+    if [ $rc -ne $2 ] || ! grep -q "$3" $DIR/out.txt; then
+        echo "FAIL: $4 (return code $rc)"
+        FAILED=1
+    else
+        echo "ok: $4"
+    fi
+}
+
+replay $DIR/good.log 0 "matches" "replay of a good log"
+
+# cut off in the middle of the last record
+size=$(wc -c < $DIR/good.log)
+head -c $((size - 5)) $DIR/good.log > $DIR/short.log
+replay $DIR/short.log 5 "is damaged" "truncated log"
+
+# header of the good log, then a record claiming nearly 4 GB
+head -c 12 $DIR/good.log > $DIR/huge.log
+printf '\000\000\000\000\001\000\000\000\377\377\377\001\220\074\100' >> $DIR/huge.log
+replay $DIR/huge.log 5 "is damaged" "record length past the limit"
+
+exit $FAILED
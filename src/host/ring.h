@@ -0,0 +1,83 @@
+/*
+    Single producer, single consumer ring (host build only)
+
+    A ring holds a power of two of fixed size records, allocated once. The
+    producer owns head and the consumer owns tail; each publishes its index
+    with a release store and reads the other's with an acquire load, so
+    neither side ever takes a lock. The two indices live on separate cache
+    lines so the stages do not keep stealing the line from each other.
+*/
+
+#ifndef _HOST_RING_H
+#define _HOST_RING_H
+#include <sched.h>
+#include <time.h>
+
+#define RING_LINE 64
+
+typedef struct {
+    uint32 head;                                  /* next record to fill */
+    uint8  pad0[RING_LINE - sizeof(uint32)];
+    uint32 tail;                                  /* next record to take */
+    uint8  pad1[RING_LINE - sizeof(uint32)];
+    uint32 mask;                                  /* records - 1 */
+    uint32 recordSize;
+    uint8* data;
+} Ring;
+
+static inline bool ringInit(Ring* r, uint32 records, uint32 recordSize) {
+    /* records must be a power of two */
+    r->head       = 0;
+    r->tail       = 0;
+    r->mask       = records - 1;
+    r->recordSize = recordSize;
+    return (r->data = (uint8*)AllocMem(records * recordSize, MEMF_PUBLIC | MEMF_CLEAR)) != 0;
+}
+
+static inline void ringFree(Ring* r) {
+    if (r->data) {
+        FreeMem(r->data, (r->mask + 1) * r->recordSize);
+        r->data = 0;
+    }
+}
+
+static inline void* ringClaim(Ring* r) {
+    /* producer: the record to fill next, 0 if the ring is full */
+    uint32 head = r->head;
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) > r->mask) {
+        return 0;
+    }
+    return r->data + (head & r->mask) * r->recordSize;
+}
+
+static inline void ringPublish(Ring* r) {
+    /* producer: hands the claimed record over */
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+static inline void* ringFront(Ring* r) {
+    /* consumer: the oldest record, 0 if the ring is empty */
+    uint32 tail = r->tail;
+    if (tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    return r->data + (tail & r->mask) * r->recordSize;
+}
+
+static inline void ringRelease(Ring* r) {
+    /* consumer: gives the front record back */
+    __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+}
+
+static inline void ringIdle(sint32* spins) {
+    /* backs off while a ring stays empty or full: yield first, then sleep */
+    static const struct timespec nap = { 0, 100000 };
+    if (++*spins < 64) {
+        sched_yield();
+    }
+    else {
+        nanosleep(&nap, 0);
+    }
+}
+
+#endif
@@ -0,0 +1,547 @@
+/*
+    Precompiled setup images
+
+    A setup image is the parsed configuration in a compact binary form, so
+    the mapper can start without any text parsing: the whole file is read
+    in one go, checked, and the table pool is pointed straight at the table
+    data inside it. All values are stored big endian.
+
+    Layout:
+        header      magic "MMAP", version, table count, size, checksum
+        tables      table count * 128 bytes, the pool from index 1 on
+        channels    16 channel records (output, flags, table slots), each
+                    followed by its sparse key map and controller range
+                    entries
+        sysex       rule count, then the SysEx rules
+        splits      split count, then the splits of all channels in order
+        pressure    16 records of the pressure table slot and bend curve
+                    point count, each followed by its points
+        ports       port count, then per port its input and output cluster
+                    names; ports after the first are each followed by their
+                    own channels, splits and pressure
+
+    The first port is described by the sections before the port list. Only
+    images of the current version are read.
+*/
+
+#include "midimapper.h"
+#include <string.h>
+
+#define IMAGE_MAGIC      0x4D4D4150 /* 'MMAP' */
+#define IMAGE_VERSION    5
+#define IMAGE_HEADER     16
+#define IMAGE_CHANNEL    20
+#define IMAGE_ENTRY      4
+#define IMAGE_RULES      4
+#define IMAGE_RULE       6
+#define IMAGE_SPLITS     4
+#define IMAGE_SPLIT      10
+#define IMAGE_PRESSURE   4
+#define IMAGE_POINT      6
+#define IMAGE_PORTS      4
+#define IMAGE_PORT       (2 * PORT_NAME)
+#define IMAGE_NONE       0xFFFF
+
+/* channel record flags */
+#define FLAG_NOSUPPRESS  0x01
+
+/* channel record table slots */
+#define SLOT_PROGRAM     0
+#define SLOT_BANKMSB     1
+#define SLOT_BANKLSB     2
+#define SLOT_TRANSPOSE   3
+#define SLOT_VELOCITY    4
+#define SLOT_CONTROL     5
+#define SLOT_CTRLINIT    6
+#define NUM_SLOTS        7
+
+/**************************************************************************/
+
+static void put16(uint8* p, uint32 v) {
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void put32(uint8* p, uint32 v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32 get16(const uint8* p) {
+    return ((uint32)p[0] << 8) | p[1];
+}
+
+static uint32 get32(const uint8* p) {
+    return ((uint32)p[0] << 24) | ((uint32)p[1] << 16) | ((uint32)p[2] << 8) | p[3];
+}
+
+static uint32 checksum(const uint8* p, uint32 len) {
+    /* rotate and add over the image body */
+    uint32 sum = 0;
+    while (len--) {
+        sum = ((sum << 1) | (sum >> 31)) + *p++;
+    }
+    return sum;
+}
+
+/**************************************************************************/
+
+static uint32 tableIndex(sint32 index) {
+    /* image slot of a pool index, IMAGE_NONE if not set */
+    return index ? index - 1 : IMAGE_NONE;
+}
+
+static uint32 imageChannelSize(const Channel* c) {
+    return IMAGE_CHANNEL + (c->noteMaps.count + c->rangeMaps.count) * IMAGE_ENTRY;
+}
+
+static uint32 imageExtraSize(const Channel* channels) {
+    /* splits and pressure sections of a channel set */
+    uint32 size = IMAGE_SPLITS;
+    sint32 i;
+    for (i = 0; i < MIDI_NUM_CHANNELS; i++) {
+        const BendCurve* b = channels[i].bendCurve;
+        size += channels[i].numSplits * IMAGE_SPLIT;
+        size += IMAGE_PRESSURE + (b ? b->numPoints * IMAGE_POINT : 0);
+    }
+    return size;
+}
+
+/**************************************************************************/
+
+static uint8* putChannels(Setup* s, uint8* p, const Channel* channels) {
+    /* writes the 16 channel records of a channel set */
+    sint32 i, j;
+    for (i = 0; i < MIDI_NUM_CHANNELS; i++) {
+        const Channel* c = &channels[i];
+        uint8*   rec = p;
+        uint32   numKeys = 0, numRanges = 0;
+        rec[0] = c->output;
+        rec[1] = c->noSuppress ? FLAG_NOSUPPRESS : 0;
+        put16(rec + 2 + 2 * SLOT_PROGRAM,   tableIndex(c->programMap));
+        put16(rec + 2 + 2 * SLOT_BANKMSB,   tableIndex(c->progBankMSBMap));
+        put16(rec + 2 + 2 * SLOT_BANKLSB,   tableIndex(c->progBankLSBMap));
+        put16(rec + 2 + 2 * SLOT_TRANSPOSE, tableIndex(c->progTransMap));
+        put16(rec + 2 + 2 * SLOT_VELOCITY,  tableIndex(c->velocityMap));
+        put16(rec + 2 + 2 * SLOT_CONTROL,   tableIndex(c->controlMap));
+        put16(rec + 2 + 2 * SLOT_CTRLINIT,  tableIndex(c->controlInit));
+        p += IMAGE_CHANNEL;
+        for (j = 0; j < c->noteMaps.count; j++) {
+            p[0] = c->noteMaps.entry[j].key;
+            put16(p + 2, tableIndex(c->noteMaps.entry[j].table));
+            p += IMAGE_ENTRY;
+            numKeys++;
+        }
+        for (j = 0; j < c->rangeMaps.count; j++) {
+            p[0] = c->rangeMaps.entry[j].key;
+            put16(p + 2, tableIndex(c->rangeMaps.entry[j].table));
+            p += IMAGE_ENTRY;
+            numRanges++;
+        }
+        put16(rec + 16, numKeys);
+        put16(rec + 18, numRanges);
+    }
+    return p;
+}
+
+static uint8* putSplits(Setup* s, uint8* p, const Channel* channels) {
+    uint32 numSplits = 0;
+    sint32 i, j;
+    for (i = 0; i < MIDI_NUM_CHANNELS; i++) {
+        numSplits += channels[i].numSplits;
+    }
+    put16(p, numSplits);
+    p += IMAGE_SPLITS;
+    for (i = 0; i < MIDI_NUM_CHANNELS; i++) {
+        const Channel* c = &channels[i];
+        for (j = 0; j < c->numSplits; j++, p += IMAGE_SPLIT) {
+            const Split* sp = &c->splits[j];
+            p[0] = i;
+            p[1] = sp->output;
+            p[2] = sp->keyLow;
+            p[3] = sp->keyHigh;
+            p[4] = sp->velLow;
+            p[5] = sp->velHigh;
+            p[6] = sp->transpose;
+            put16(p + 8, tableIndex(sp->velocityMap));
+        }
+    }
+    return p;
+}
+
+static uint8* putPressure(Setup* s, uint8* p, const Channel* channels) {
+    sint32 i, j;
+    for (i = 0; i < MIDI_NUM_CHANNELS; i++) {
+        const Channel*   c = &channels[i];
+        const BendCurve* b = c->bendCurve;
+        put16(p, tableIndex(c->pressureMap));
+        p[2] = b ? b->numPoints : 0;
+        p += IMAGE_PRESSURE;
+        for (j = 0; b && j < b->numPoints; j++, p += IMAGE_POINT) {
+            put16(p, b->x[j]);
+            put32(p + 2, (uint32)b->y[j]);
+        }
+    }
+    return p;
+}
+
+/**************************************************************************/
+
+bool saveSetupImage(Setup* s, const char* fName) {
+    /* writes a loaded setup as an image */
+    SysExRule* r;
+    uint32 numRules  = 0;
+    FILE*  file;
+    uint8* buf;
+    uint8* p;
+    uint32 numTables = s->poolSize ? s->poolSize - 1 : 0;
+    uint32 size      = IMAGE_HEADER;
+    sint32 i, j;
+    bool   ok;
+
+    size += numTables * MIDI_TABLE_SIZE;
+    for (r = s->sysexList; r; r = r->next) {
+        size += IMAGE_RULE;
+        numRules++;
+    }
+    size += IMAGE_RULES + IMAGE_PORTS + s->numPorts * IMAGE_PORT;
+    for (i = 0; i < s->numPorts; i++) {
+        const Channel* channels = s->ports[i].channels;
+        for (j = 0; j < MIDI_NUM_CHANNELS; j++) {
+            size += imageChannelSize(&channels[j]);
+        }
+        size += imageExtraSize(channels);
+    }
+    if (!(buf = (uint8*)AllocMem(size, MEMF_PUBLIC | MEMF_CLEAR))) {
+        puts("*** unable to allocate image buffer");
+        return false;
+    }
+
+    p = buf + IMAGE_HEADER;
+    for (i = 1; i <= (sint32)numTables; i++) {
+        for (j = 0; j < MIDI_TABLE_SIZE; j++) {
+            *p++ = s->pool[i][j];
+        }
+    }
+    p = putChannels(s, p, s->ports[0].channels);
+    put16(p, numRules);
+    p += IMAGE_RULES;
+    for (r = s->sysexList; r; r = r->next, p += IMAGE_RULE) {
+        p[0] = r->manufacturer;
+        p[1] = r->model == SYSEX_ANY_MODEL ? 0xFF : r->model;
+        p[2] = r->device;
+        p[3] = r->deviceMask;
+        p[4] = r->flags;
+    }
+    p = putSplits(s, p, s->ports[0].channels);
+    p = putPressure(s, p, s->ports[0].channels);
+    put16(p, s->numPorts);
+    p += IMAGE_PORTS;
+    for (i = 0; i < s->numPorts; i++) {
+        const Port* port = &s->ports[i];
+        strncpy((char*)p, port->inName, PORT_NAME);
+        strncpy((char*)p + PORT_NAME, port->outName, PORT_NAME);
+        p += IMAGE_PORT;
+        if (i) {
+            p = putChannels(s, p, port->channels);
+            p = putSplits(s, p, port->channels);
+            p = putPressure(s, p, port->channels);
+        }
+    }
+
+    put32(buf,      IMAGE_MAGIC);
+    put16(buf + 4,  IMAGE_VERSION);
+    put16(buf + 6,  numTables);
+    put32(buf + 8,  size);
+    put32(buf + 12, checksum(buf + IMAGE_HEADER, size - IMAGE_HEADER));
+
+    ok = false;
+    if ((file = fopen(fName, "wb"))) {
+        ok = fwrite(buf, 1, size, file) == size;
+        ok = (fclose(file) == 0) && ok;
+        if (!ok) {
+            /* a partial image would only be rejected later */
+            remove(fName);
+        }
+    }
+    FreeMem(buf, size);
+    if (!ok) {
+        printf("*** unable to write image %s\n", fName);
+        return false;
+    }
+    printf("wrote image %s: %lu tables, %lu bytes\n", fName, (unsigned long)numTables, (unsigned long)size);
+    return true;
+}
+
+/**************************************************************************/
+
+bool isSetupImage(const char* fName) {
+    /* checks for the image magic */
+    uint8 head[4];
+    FILE* file;
+    bool  isImage = false;
+    if ((file = fopen(fName, "rb"))) {
+        isImage = fread(head, 1, 4, file) == 4 && get32(head) == IMAGE_MAGIC;
+        fclose(file);
+    }
+    return isImage;
+}
+
+/**************************************************************************/
+
+static uint8 imageTable(Setup* s, uint32 index, uint32 numTables, bool* ok) {
+    /* pool index of an image slot */
+    if (index == IMAGE_NONE) {
+        return 0;
+    }
+    if (index >= numTables) {
+        *ok = false;
+        return 0;
+    }
+    return index + 1;
+}
+
+static uint8* getChannels(Setup* s, uint8* p, uint8* end, Channel* channels, uint32 numTables, bool* ok) {
+    /* reads the 16 channel records of a channel set, 0 if they run past end */
+    sint32 i, j;
+    for (i = 0; i < MIDI_NUM_CHANNELS; i++) {
+        Channel* c = &channels[i];
+        uint32   numKeys, numRanges;
+        if (p + IMAGE_CHANNEL > end) {
+            return 0;
+        }
+        c->output         = p[0] & 0x0F;
+        c->noSuppress     = (p[1] & FLAG_NOSUPPRESS) != 0;
+        c->programMap     = imageTable(s, get16(p + 2 + 2 * SLOT_PROGRAM),   numTables, ok);
+        c->progBankMSBMap = imageTable(s, get16(p + 2 + 2 * SLOT_BANKMSB),   numTables, ok);
+        c->progBankLSBMap = imageTable(s, get16(p + 2 + 2 * SLOT_BANKLSB),   numTables, ok);
+        c->progTransMap   = imageTable(s, get16(p + 2 + 2 * SLOT_TRANSPOSE), numTables, ok);
+        c->velocityMap    = imageTable(s, get16(p + 2 + 2 * SLOT_VELOCITY),  numTables, ok);
+        c->controlMap     = imageTable(s, get16(p + 2 + 2 * SLOT_CONTROL),   numTables, ok);
+        c->controlInit    = imageTable(s, get16(p + 2 + 2 * SLOT_CTRLINIT),  numTables, ok);
+        numKeys           = get16(p + 16);
+        numRanges         = get16(p + 18);
+        p += IMAGE_CHANNEL;
+        if (numKeys > MIDI_TABLE_SIZE || numRanges > MIDI_NUM_CONTROLLERS ||
+            p + (numKeys + numRanges) * IMAGE_ENTRY > end) {
+            return 0;
+        }
+        for (j = 0; j < (sint32)numKeys; j++, p += IMAGE_ENTRY) {
+            sint32 index = imageTable(s, get16(p + 2), numTables, ok);
+            if (index && !setSparse(s, &c->noteMaps, p[0] & 0x7F, index)) {
+                return 0;
+            }
+        }
+        for (j = 0; j < (sint32)numRanges; j++, p += IMAGE_ENTRY) {
+            sint32 index = imageTable(s, get16(p + 2), numTables, ok);
+            if (index && !setSparse(s, &c->rangeMaps, p[0] & 0x7F, index)) {
+                return 0;
+            }
+        }
+    }
+    return p;
+}
+
+static uint8* getSplits(Setup* s, uint8* p, uint8* end, Channel* channels, uint32 numTables, bool* ok) {
+    uint32 numSplits;
+    sint32 j;
+    if (p + IMAGE_SPLITS > end) {
+        return 0;
+    }
+    numSplits = get16(p);
+    p += IMAGE_SPLITS;
+    if (p + numSplits * IMAGE_SPLIT > end) {
+        return 0;
+    }
+    for (j = 0; j < (sint32)numSplits; j++, p += IMAGE_SPLIT) {
+        Split* sp;
+        if (p[0] >= MIDI_NUM_CHANNELS || p[2] > p[3] || p[3] > 127 || !p[4] || p[4] > p[5] || p[5] > 127 ||
+            !(sp = allocSplit(s, &channels[p[0]]))) {
+            return 0;
+        }
+        sp->output      = p[1] & 0x0F;
+        sp->keyLow      = p[2];
+        sp->keyHigh     = p[3];
+        sp->velLow      = p[4];
+        sp->velHigh     = p[5];
+        sp->transpose   = (sint8)p[6];
+        sp->velocityMap = imageTable(s, get16(p + 8), numTables, ok);
+    }
+    return p;
+}
+
+static uint8* getPressure(Setup* s, uint8* p, uint8* end, Channel* channels, uint32 numTables, bool* ok) {
+    sint32 i, j;
+    for (i = 0; i < MIDI_NUM_CHANNELS; i++) {
+        Channel*   c = &channels[i];
+        BendCurve* b;
+        uint32     numPoints;
+        if (p + IMAGE_PRESSURE > end) {
+            return 0;
+        }
+        c->pressureMap = imageTable(s, get16(p), numTables, ok);
+        numPoints      = p[2];
+        p += IMAGE_PRESSURE;
+        if (!numPoints) {
+            continue;
+        }
+        if (numPoints < 2 || numPoints > BEND_POINTS || p + numPoints * IMAGE_POINT > end || !(b = allocBendCurve(s, c))) {
+            return 0;
+        }
+        for (j = 0; j < (sint32)numPoints; j++, p += IMAGE_POINT) {
+            b->x[j] = get16(p);
+            b->y[j] = (sint32)get32(p + 2);
+            if (b->x[j] > BEND_MAX || (j && b->x[j] <= b->x[j - 1])) {
+                *ok = false;
+            }
+        }
+        b->numPoints = numPoints;
+    }
+    return p;
+}
+
+static uint8* getPorts(Setup* s, uint8* p, uint8* end, uint32 numTables, bool* ok) {
+    /* the port list, the first port being the one already read */
+    uint32 numPorts;
+    sint32 i;
+    if (p + IMAGE_PORTS > end) {
+        return 0;
+    }
+    numPorts = get16(p);
+    p += IMAGE_PORTS;
+    if (numPorts < 1 || numPorts > PORT_MAX) {
+        return 0;
+    }
+    for (i = 0; i < (sint32)numPorts; i++) {
+        Port* port;
+        if (p + IMAGE_PORT > end || !p[0] || p[PORT_NAME - 1] || !p[PORT_NAME] || p[IMAGE_PORT - 1]) {
+            return 0;
+        }
+        if (i == 0) {
+            port = &s->ports[0];
+            strcpy(port->inName, (char*)p);
+            strcpy(port->outName, (char*)p + PORT_NAME);
+        }
+        else if (!(port = allocPort(s, (char*)p, (char*)p + PORT_NAME))) {
+            return 0;
+        }
+        p += IMAGE_PORT;
+        if (i && !(
+            (p = getChannels(s, p, end, port->channels, numTables, ok)) &&
+            (p = getSplits(s, p, end, port->channels, numTables, ok)) &&
+            (p = getPressure(s, p, end, port->channels, numTables, ok))
+        )) {
+            return 0;
+        }
+    }
+    return p;
+}
+
+bool loadSetupImage(Setup* s, const char* fName) {
+    /* reads and validates an image, then points the channels into it */
+    FILE*  file;
+    uint8* p;
+    uint8* end;
+    uint32 numTables;
+    uint32 version;
+    sint32 j;
+    bool   ok = true;
+
+    printf("\nloadSetupImage(%s)\n", fName);
+    if (!(file = fopen(fName, "rb"))) {
+        printf("*** unable to open %s\n", fName);
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    s->imageSize = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (s->imageSize < IMAGE_HEADER || !(s->image = (uint8*)AllocMem(s->imageSize, MEMF_PUBLIC))) {
+        fclose(file);
+        s->imageSize = 0;
+        puts("*** unable to allocate image");
+        return false;
+    }
+    if (fread(s->image, 1, s->imageSize, file) != s->imageSize) {
+        ok = false;
+    }
+    fclose(file);
+
+    version = get16(s->image + 4);
+    if (!ok ||
+        get32(s->image)      != IMAGE_MAGIC ||
+        version              != IMAGE_VERSION ||
+        get32(s->image + 8)  != s->imageSize ||
+        get32(s->image + 12) != checksum(s->image + IMAGE_HEADER, s->imageSize - IMAGE_HEADER)
+    ) {
+        printf("*** %s is not a valid version %d setup image\n", fName, IMAGE_VERSION);
+        return false;
+    }
+
+    numTables = get16(s->image + 6);
+    end       = s->image + s->imageSize;
+    if (numTables >= TABLE_POOL || IMAGE_HEADER + numTables * MIDI_TABLE_SIZE > s->imageSize) {
+        printf("*** %s has more than %d tables\n", fName, TABLE_POOL - 1);
+        return false;
+    }
+    /* the pool is the table section, in place */
+    for (j = 0; j < (sint32)numTables; j++) {
+        s->pool[j + 1] = s->image + IMAGE_HEADER + j * MIDI_TABLE_SIZE;
+    }
+    s->poolSize = numTables + 1;
+    /* the first port, the default one unless the port list names it */
+    if (!allocPort(s, "MidiIn", "MidiOut")) {
+        puts("*** unable to allocate channels");
+        return false;
+    }
+    p         = getChannels(s, s->image + IMAGE_HEADER + numTables * MIDI_TABLE_SIZE, end, s->channels, numTables, &ok);
+    if (p) {
+        uint32 numRules;
+        if (p + IMAGE_RULES > end) {
+            p = 0;
+        }
+        else {
+            numRules = get16(p);
+            p += IMAGE_RULES;
+            if (p + numRules * IMAGE_RULE > end) {
+                p = 0;
+            }
+            for (j = 0; p && j < (sint32)numRules; j++, p += IMAGE_RULE) {
+                SysExRule* r;
+                if (!p[0] || p[0] > 0x7F || !(r = allocSysExRule(s, p[0], p[1] == 0xFF ? SYSEX_ANY_MODEL : p[1] & 0x7F))) {
+                    p = 0;
+                    break;
+                }
+                r->device     = p[2] & 0x7F;
+                r->deviceMask = p[3] & 0x7F;
+                r->flags      = p[4] & (SYSEX_DEVICE | SYSEX_CHECKSUM);
+            }
+        }
+    }
+    if (p) {
+        p = getSplits(s, p, end, s->channels, numTables, &ok);
+    }
+    if (p) {
+        p = getPressure(s, p, end, s->channels, numTables, &ok);
+    }
+    if (p) {
+        p = getPorts(s, p, end, numTables, &ok);
+    }
+    if (!ok || p != end) {
+        printf("*** %s is corrupt\n", fName);
+        return false;
+    }
+    printf("loaded %lu tables, %lu bytes\n", (unsigned long)numTables, (unsigned long)s->imageSize);
+    return true;
+}
+
+/**************************************************************************/
+
+void freeSetupImage(Setup* s) {
+    if (s->image) {
+        FreeMem(s->image, s->imageSize);
+    }
+    s->image     = 0;
+    s->imageSize = 0;
+}
@@ -0,0 +1,235 @@
+/*
+    Config file tokenizer
+
+    The whole file is read into one buffer and split into tokens in a
+    single pass. Tokens are runs of non-blank characters, except that
+    braces always stand alone and // starts a comment to the end of the
+    line. A run is classified as a number (integer, 0x hex or decimal), an
+    index:value pair or otherwise a word. Every token carries the line and
+    column it started at, for error reports.
+*/
+
+#include "midimapper.h"
+#include <stdarg.h>
+#include <string.h>
+
+/**************************************************************************/
+
+bool openLexer(Lexer* lx, const char* fName) {
+    /* reads the whole file in */
+    FILE*  file;
+    sint32 size;
+    lx->fName = fName;
+    lx->buf   = 0;
+    lx->type  = TOK_END;
+    if (!(file = fopen(fName, "rb"))) {
+        printf("*** unable to open %s\n", fName);
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (size < 0 || !(lx->buf = (char*)AllocMem(size + 1, MEMF_PUBLIC))) {
+        fclose(file);
+        printf("*** unable to allocate parse buffer for %s\n", fName);
+        return false;
+    }
+    lx->size = size + 1;
+    if ((sint32)fread(lx->buf, 1, size, file) != size) {
+        fclose(file);
+        closeLexer(lx);
+        printf("*** unable to read %s\n", fName);
+        return false;
+    }
+    fclose(file);
+    lx->buf[size]  = 0;
+    lx->pos        = lx->buf;
+    lx->end        = lx->buf + size;
+    lx->lineStart  = lx->buf;
+    lx->line       = 1;
+    return true;
+}
+
+/**************************************************************************/
+
+void closeLexer(Lexer* lx) {
+    if (lx->buf) {
+        FreeMem(lx->buf, lx->size);
+        lx->buf = 0;
+    }
+}
+
+/**************************************************************************/
+
+bool lexError(Lexer* lx, const char* format, ...) {
+    /* reports an error at the current token, always returns false */
+    va_list args;
+    printf("*** %s:%ld:%ld: ", lx->fName, (long)lx->tokLine, (long)lx->tokCol);
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    printf("\n");
+    return false;
+}
+
+/**************************************************************************/
+
+static bool isBlank(sint32 c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\f' || c == '\v';
+}
+
+static const char* scanInteger(const char* p, const char* end, sint32* value) {
+    /* optionally signed decimal or 0x hex integer, returns 0 if there is none */
+    sint32 v    = 0;
+    bool   neg  = false;
+    bool   some = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        neg = *p++ == '-';
+    }
+    if (p + 2 < end && p[0] == '0' && (p[1] | 0x20) == 'x') {
+        /* hexadecimal, as SysEx IDs are usually written */
+        for (p += 2; p < end; p++, some = true) {
+            sint32 c = *p | 0x20;
+            if (*p >= '0' && *p <= '9') {
+                c = *p - '0';
+            }
+            else if (c >= 'a' && c <= 'f') {
+                c -= 'a' - 10;
+            }
+            else {
+                break;
+            }
+            if (v < 0x1000000) {
+                v = (v << 4) | c;
+            }
+        }
+        *value = neg ? -v : v;
+        return some ? p : 0;
+    }
+    while (p < end && *p >= '0' && *p <= '9') {
+        if (v < 100000000) {
+            v = v * 10 + (*p - '0');
+        }
+        p++;
+        some = true;
+    }
+    *value = neg ? -v : v;
+    return some ? p : 0;
+}
+
+static void classify(Lexer* lx, const char* p, const char* end) {
+    /* works out what a run of characters is */
+    const char* q;
+    lx->type   = TOK_WORD;
+    lx->isReal = false;
+    if ((q = scanInteger(p, end, &lx->value))) {
+        if (q == end) {
+            lx->type  = TOK_NUMBER;
+            lx->fixed = (lx->value < -32767 ? -32767 : lx->value > 32767 ? 32767 : lx->value) * FIX_ONE;
+        }
+        else if (*q == ':' && scanInteger(q + 1, end, &lx->value2) == end) {
+            lx->type = TOK_PAIR;
+        }
+        else if (*q == '.' && q + 1 < end) {
+            /* 16.16 fixed point, from up to 4 decimal places */
+            sint32 whole = lx->value < 0 ? -lx->value : lx->value;
+            sint32 frac  = 0;
+            sint32 scale = 1;
+            for (q++; q < end && *q >= '0' && *q <= '9'; q++) {
+                if (scale < 10000) {
+                    frac   = frac * 10 + (*q - '0');
+                    scale *= 10;
+                }
+            }
+            if (q == end) {
+                whole      = whole > 32767 ? 32767 : whole;
+                lx->type   = TOK_NUMBER;
+                lx->isReal = true;
+                lx->fixed  = (whole << 16) + (sint32)(((uint32)frac * 65536 + scale / 2) / scale);
+                lx->fixed  = *p == '-' ? -lx->fixed : lx->fixed;
+            }
+        }
+    }
+}
+
+bool nextToken(Lexer* lx) {
+    /* moves to the next token, false on a malformed one */
+    const char* p   = lx->pos;
+    const char* end = lx->end;
+    const char* start;
+    sint32      len;
+
+    /* skip blanks and comments */
+    for (;;) {
+        while (p < end && isBlank(*p)) {
+            if (*p++ == '\n') {
+                lx->line++;
+                lx->lineStart = p;
+            }
+        }
+        if (p + 1 < end && p[0] == '/' && p[1] == '/') {
+            while (p < end && *p != '\n') {
+                p++;
+            }
+            continue;
+        }
+        break;
+    }
+    lx->tokLine = lx->line;
+    lx->tokCol  = (sint32)(p - lx->lineStart) + 1;
+    lx->word[0] = 0;
+    if (p == end) {
+        lx->pos  = p;
+        lx->type = TOK_END;
+        return true;
+    }
+    if (*p == '{' || *p == '}') {
+        lx->type    = *p == '{' ? TOK_LBRACE : TOK_RBRACE;
+        lx->word[0] = *p++;
+        lx->word[1] = 0;
+        lx->pos     = p;
+        return true;
+    }
+    start = p;
+    while (p < end && !isBlank(*p) && *p != '{' && *p != '}' && !(p[0] == '/' && p + 1 < end && p[1] == '/')) {
+        p++;
+    }
+    lx->pos = p;
+    len     = (sint32)(p - start);
+    if (len >= LEX_WORD_SIZE) {
+        return lexError(lx, "token too long");
+    }
+    memcpy(lx->word, start, len);
+    lx->word[len] = 0;
+    classify(lx, start, p);
+    return true;
+}
+
+/**************************************************************************/
+
+bool expectToken(Lexer* lx, sint32 type, const char* what) {
+    /* reads the next token, which must be of the given type */
+    if (!nextToken(lx)) {
+        return false;
+    }
+    if (lx->type != type) {
+        if (lx->type == TOK_END) {
+            return lexError(lx, "expected %s, found end of file", what);
+        }
+        return lexError(lx, "expected %s, found '%s'", what, lx->word);
+    }
+    return true;
+}
+
+/**************************************************************************/
+
+bool expectInteger(Lexer* lx, sint32 min, sint32 max, const char* what) {
+    /* reads an integer in the range min..max into lx->value */
+    if (!expectToken(lx, TOK_NUMBER, what)) {
+        return false;
+    }
+    if (lx->isReal || lx->value < min || lx->value > max) {
+        return lexError(lx, "%s must be a whole number %ld..%ld", what, (long)min, (long)max);
+    }
+    return true;
+}
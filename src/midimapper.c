@@ -4,43 +4,228 @@
 */
 
 #include "midimapper.h"
+#include <dos/dostags.h>
+#include <string.h>
+#include <stdlib.h>
 
 /**************************************************************************/
 
 struct Library* MidiBase = 0;
-struct MSource* source   = 0;
-struct MDest*   dest     = 0;
-struct MRoute*  sRoute   = 0;
-struct MRoute*  dRoute   = 0;
-const char*     sName    = "MidiOut";
-const char*     dName    = "MidiIn";
+const char*     cfgFile  = "remap.cfg";
+bool            runningStatus = false; /* RUNNINGSTATUS option */
+bool            pipelined     = false; /* PIPELINE mode running, host build */
+bool            replaying     = false; /* REPLAY mode, links are not opened */
 
-extern Channel* channels;
+extern Setup*   setup;
+extern TASK_LOCAL Channel* channels;
+
+/* config reload, see startReload() */
+#define LOADER_IDLE    0
+#define LOADER_LOADING 1
+#define LOADER_READY   2
+#define LOADER_FREEING 3
+
+struct Task*     mainTask     = 0;
+struct Process*  loader       = 0;
+sint32           loaderSig    = -1;
+volatile sint32  loaderState  = LOADER_IDLE;
+Setup* volatile  loadedSetup  = 0;
+Setup* volatile  retiredSetup = 0;
 
 typedef uint32 (*FillBuffer)(void);
 
 FillBuffer dummyFill = 0;
 
+/*
+    Output is collected in one buffer per output link and written with a
+    single PutMidiStream() per drain cycle or init burst. It is large
+    enough for every initial controller of every channel, or all held
+    notes released.
+*/
+#define OUTPUT_BUFFER REMAP_MAX_RELEASE
+
+/*
+    One link per cluster named by the ports of a setup. Ports sharing an
+    input fan out from one MDest, ports sharing an output merge into one
+    MSource. Links are opened as setups name them and stay open until
+    exit, so a reload only ever adds to them.
+*/
+#define LINK_MAX PORT_MAX
+
+typedef struct {
+    char           name[PORT_NAME];
+    struct MDest*  dest;
+    struct MRoute* route;
+} InLink;
+
+typedef struct {
+    char            name[PORT_NAME];
+    struct MSource* source;
+    struct MRoute*  route;
+    sint32          index;                                    /* in outLinks[] */
+    sint32          len;
+    uint8           status;                                   /* running status on the link */
+    uint8           shadow[MIDI_NUM_CHANNELS * MIDI_NUM_CONTROLLERS]; /* see useShadow() */
+    uint8           buffer[OUTPUT_BUFFER];
+} OutLink;
+
+static InLink   inLinks[LINK_MAX];
+static OutLink* outLinks[LINK_MAX];
+static sint32   numInLinks  = 0;
+static sint32   numOutLinks = 0;
+static OutLink* out         = 0; /* link of the port being remapped */
+
 /**************************************************************************/
 
-void done(void) {
-    fflush(stdout);
-    if (dRoute) {
-        DeleteMRoute(dRoute);
-        dRoute = 0;
+void closeLinks(void) {
+    sint32 i;
+    for (i = 0; i < numInLinks; i++) {
+        if (inLinks[i].route) {
+            DeleteMRoute(inLinks[i].route);
+        }
+        if (inLinks[i].dest) {
+            DeleteMDest(inLinks[i].dest);
+        }
     }
-    if (sRoute) {
-        DeleteMRoute(sRoute);
-        sRoute = 0;
+    for (i = 0; i < numOutLinks; i++) {
+        if (outLinks[i]->route) {
+            DeleteMRoute(outLinks[i]->route);
+        }
+        if (outLinks[i]->source) {
+            DeleteMSource(outLinks[i]->source);
+        }
+        FreeMem(outLinks[i], sizeof(OutLink));
     }
-    if (dest) {
-        DeleteMDest(dest);
-        dest = 0;
+    numInLinks  = 0;
+    numOutLinks = 0;
+    out         = 0;
+}
+
+/**************************************************************************/
+
+static sint32 inLink(const char* name) {
+    /* finds or opens the input link for a cluster, -1 on failure */
+    InLink* l;
+    sint32  i;
+    for (i = 0; i < numInLinks; i++) {
+        if (strcmp(inLinks[i].name, name) == 0) {
+            return i;
+        }
+    }
+    if (numInLinks == LINK_MAX) {
+        printf("*** more than %d input clusters\n", LINK_MAX);
+        return -1;
+    }
+    l = &inLinks[numInLinks];
+    strcpy(l->name, name);
+    if (replaying) {
+        l->dest  = 0;
+        l->route = 0;
+        return numInLinks++;
+    }
+    if (!(l->dest = CreateMDest(0, 0))) {
+        printf("Couldn't create MDest\n");
+        return -1;
+    }
+    if (!(l->route = MRouteDest(l->name, l->dest, 0))) {
+        printf("Coudln't create dest Route for %s\n", l->name);
+        DeleteMDest(l->dest);
+        l->dest = 0;
+        return -1;
+    }
+    if (capturing) {
+        captureRecord(CAPTURE_INLINK, numInLinks, 0, (uint8*)name, strlen(name));
+    }
+    return numInLinks++;
+}
+
+static sint32 outLink(const char* name) {
+    /* finds or opens the output link for a cluster, -1 on failure */
+    OutLink* l;
+    sint32   i;
+    for (i = 0; i < numOutLinks; i++) {
+        if (strcmp(outLinks[i]->name, name) == 0) {
+            return i;
+        }
+    }
+    if (numOutLinks == LINK_MAX) {
+        printf("*** more than %d output clusters\n", LINK_MAX);
+        return -1;
+    }
+    if (!(l = (OutLink*)AllocMem(sizeof(OutLink), MEMF_PUBLIC | MEMF_CLEAR))) {
+        printf("Couldn't allocate output buffer\n");
+        return -1;
+    }
+    strcpy(l->name, name);
+    if (replaying) {
+        /* sent bytes go to replayOutput() */
+    }
+    else if (!(l->source = CreateMSource(0, 0)) || !(l->route = MRouteSource(l->source, l->name, 0))) {
+        printf("Coudln't create source Route for %s\n", l->name);
+        if (l->source) {
+            DeleteMSource(l->source);
+        }
+        FreeMem(l, sizeof(OutLink));
+        return -1;
+    }
+    else if (capturing) {
+        captureRecord(CAPTURE_OUTLINK, numOutLinks, 0, (uint8*)name, strlen(name));
     }
-    if (source) {
-        DeleteMSource(source);
-        source = 0;
+    outLinks[numOutLinks] = l;
+    l->index = numOutLinks;
+    return numOutLinks++;
+}
+
+static bool openInLinks(Setup* s) {
+    /* opens the input clusters named by the ports of a setup, reusing open ones */
+    sint32 i, in;
+    for (i = 0; i < s->numPorts; i++) {
+        if ((in = inLink(s->ports[i].inName)) < 0) {
+            return false;
+        }
+        s->ports[i].in = in;
     }
+    return true;
+}
+
+static bool openOutLinks(Setup* s) {
+    /*
+        Opens the output clusters of a setup. While pipelined only the
+        remap process may do this: it alone walks outLinks[] to flush, and
+        the send process learns of a new link through the ring.
+    */
+    sint32 i, out;
+    for (i = 0; i < s->numPorts; i++) {
+        if ((out = outLink(s->ports[i].outName)) < 0) {
+            return false;
+        }
+        s->ports[i].out = out;
+    }
+    return true;
+}
+
+bool openLinks(Setup* s) {
+    /* opens the clusters named by the ports of a setup, reusing open ones */
+    return openInLinks(s) && openOutLinks(s);
+}
+
+static void selectPort(const Port* p) {
+    /* directs remapping to a port's channels and output link */
+    channels = p->channels;
+    out      = outLinks[p->out];
+    useShadow(out->shadow);
+}
+
+/**************************************************************************/
+
+void done(void) {
+    fflush(stdout);
+    closeStats();
+    if (loaderSig != -1) {
+        FreeSignal(loaderSig);
+        loaderSig = -1;
+    }
+    closeLinks();
     if (MidiBase) {
         CloseLibrary(MidiBase);
         MidiBase = 0;
@@ -50,26 +235,16 @@ void done(void) {
 /**************************************************************************/
 
 bool init(void) {
-    if (!(MidiBase = OpenLibrary(MIDINAME, MIDIVERSION))) {
-        printf("Couldn't open %s version %ld\n", MIDINAME, MIDIVERSION);
-        return false;
-    }
-    if (!(dest = CreateMDest(0, 0))) {
-        printf("Couldn't create MDest\n");
-        return false;
-    }
-    if (!(dRoute = MRouteDest(dName, dest, 0))) {
-        printf("Coudln't create dest Route\n");
-        return false;
-    }
-    if (!(source = CreateMSource(0, 0))) {
-        printf("Couldn't create MSource\n");
+    mainTask = FindTask(0);
+    if ((loaderSig = AllocSignal(-1)) == -1) {
+        printf("Couldn't allocate reload signal\n");
         return false;
     }
-    if (!(sRoute = MRouteSource(source, sName, 0))) {
-        printf("Coudln't create source Route\n");
+    if (!(MidiBase = OpenLibrary(MIDINAME, MIDIVERSION))) {
+        printf("Couldn't open %s version %ld\n", MIDINAME, MIDIVERSION);
         return false;
     }
+    openStats();
     return true;
 }
 
@@ -94,71 +269,1026 @@ void showPacket(struct MidiPacket* packet) {
 
 /**************************************************************************/
 
-void processPacket(struct MidiPacket* packet) {
-    char outBuffer[256];
-    if (packet->Type != MMF_SYSEX) {
-        sint32 len = remapMIDIData(outBuffer, packet->MidiMsg, packet->Length);
-        PutMidiStream(source, dummyFill, outBuffer, len, len);
+#ifdef MIDIMAPPER_HOST
+static void queueOutput(OutLink* l, const uint8* buf, sint32 len);
+static void queueStamps(void);
+static void queueSetup(Setup* s);
+#endif
+static void replayOutput(sint32 link, sint32 side, const uint8* buf, sint32 len);
+
+#define REPLAY_RECORDED 0
+#define REPLAY_REMAPPED 1
+
+static void sendBytes(OutLink* l, uint8* buf, sint32 len) {
+    /* writes to a link, or passes the bytes to the send stage of a pipeline */
+#ifdef MIDIMAPPER_HOST
+    if (pipelined) {
+        queueOutput(l, buf, len);
+        return;
+    }
+#endif
+    if (replaying) {
+        replayOutput(l->index, REPLAY_REMAPPED, buf, len);
+        return;
+    }
+    if (capturing) {
+        captureRecord(CAPTURE_OUT, l->index, 0, buf, len);
+    }
+    PutMidiStream(l->source, dummyFill, buf, len, len);
+}
+
+static void flushLink(OutLink* l) {
+    if (l->len && runningStatus) {
+        l->len = compressRunningStatus(&l->status, l->buffer, l->len);
+    }
+    if (l->len) {
+        sendBytes(l, l->buffer, l->len);
+        l->len = 0;
+    }
+}
+
+void flushOutput(void) {
+    sint32 i;
+    for (i = 0; i < numOutLinks; i++) {
+        flushLink(outLinks[i]);
+    }
+#ifdef MIDIMAPPER_HOST
+    if (pipelined) {
+        /* the send stage measures latency once it has written the bytes */
+        queueStamps();
+        return;
     }
+#endif
+    recordLatency();
+}
+
+static uint8* reserveOutput(sint32 len) {
+    /* room for len more bytes on the selected link, flushing first if full */
+    if (out->len + len > OUTPUT_BUFFER) {
+        flushOutput();
+    }
+    return out->buffer + out->len;
+}
+
+/**************************************************************************/
+
+void processPacket(struct MidiPacket* packet, sint32 link) {
+    /* remaps a packet for every port on the input link it came from */
+    sint32 i, len = 0;
+    uint32 sent = 0;                               /* output links a SysEx packet went to */
+    if (capturing) {
+        captureRecord(CAPTURE_IN, link, packet->Type, packet->MidiMsg, packet->Length);
+    }
+    if (packet->Type == MMF_SYSEX) {
+        /*
+            Sent straight from the packet after the output queued so far.
+            The rules work in place, so even a bulk dump is not copied.
+        */
+        len = remapSysEx(packet->MidiMsg, packet->Length);
+        flushOutput();
+    }
+    for (i = 0; i < setup->numPorts; i++) {
+        const Port* p = &setup->ports[i];
+        if (p->in != link) {
+            continue;
+        }
+        if (len) {
+            /* SysEx is not remapped per port, each output gets it once */
+            if (sent & (1UL << p->out)) {
+                continue;
+            }
+            sent |= 1UL << p->out;
+            selectPort(p);
+            sendBytes(out, packet->MidiMsg, len);
+            out->status = 0;
+            traffic.sysexPackets++;
+            traffic.sysexBytes += len;
+        }
+        else {
+            selectPort(p);
+            out->len += remapMIDIData(reserveOutput(REMAP_MAX_OUTPUT), packet->MidiMsg, packet->Length);
+        }
+    }
+    if (len && !pipelined) {
+        recordLatency();
+    }
+}
+
+/**************************************************************************/
+
+void initChannels(void) {
+    /* sends the initial controller values as one burst */
+    sint32 i, j, k;
+    for (k = 0; k < numOutLinks; k++) {
+        useShadow(outLinks[k]->shadow);
+        clearShadow();
+    }
+    for (k = 0; k < setup->numPorts; k++) {
+        selectPort(&setup->ports[k]);
+        for (i = 0; i < MIDI_NUM_CHANNELS; i++) {
+            const uint8* init = poolTable(setup, channels[i].controlInit);
+            if (init) {
+                for (j = 0; j<MIDI_NUM_CONTROLLERS; j++) {
+                    if (init[j] < 0x80) {
+                        uint8* initBuffer = reserveOutput(3);
+                        initBuffer[0] = MS_CTRL | channels[i].output;
+                        initBuffer[1] = j;
+                        initBuffer[2] = init[j];
+                        out->len += 3;
+                    }
+                }
+            }
+        }
+    }
+    flushOutput();
+}
+
+/**************************************************************************/
+
+void releaseHeldNotes(void) {
+    sint32 i;
+    flushOutput();
+    for (i = 0; i < setup->numPorts; i++) {
+        selectPort(&setup->ports[i]);
+        out->len += releaseAllNotes(reserveOutput(REMAP_MAX_RELEASE));
+    }
+    flushOutput();
+}
+
+/**************************************************************************/
+
+void loaderMain(void) {
+    /*
+        Loader process entry. Runs below the mapper's priority, so parsing
+        only ever uses time the mapper is waiting anyway. Hands the new
+        setup over, then frees the one it replaced.
+    */
+    loadedSetup = loadSetup(cfgFile);
+    loaderState = LOADER_READY;
+    Signal(mainTask, 1L << loaderSig);
+    Wait(SIGBREAKF_CTRL_F);
+    freeSetup(retiredSetup);
+    retiredSetup = 0;
+    Forbid();
+    loaderState = LOADER_IDLE;
+    Signal(mainTask, 1L << loaderSig);
+}
+
+/**************************************************************************/
+
+void startReload(void) {
+    /* starts re-reading the config into a second setup */
+    if (loaderState != LOADER_IDLE) {
+        printf("reload already in progress\n");
+        return;
+    }
+    loaderState = LOADER_LOADING;
+    loader = CreateNewProcTags(
+        NP_Entry,    loaderMain,
+        NP_Name,     "midimapper loader",
+        NP_Priority, 0L,
+        TAG_DONE
+    );
+    if (!loader) {
+        loaderState = LOADER_IDLE;
+        printf("*** couldn't start loader\n");
+    }
+}
+
+/**************************************************************************/
+
+bool swapReloaded(void) {
+    /* swaps in a freshly loaded setup, returns true if one was swapped in */
+    Setup* s = loadedSetup;
+    if (loaderState != LOADER_READY) {
+        return false;
+    }
+    loadedSetup = 0;
+    loaderState = LOADER_FREEING;
+#ifdef MIDIMAPPER_HOST
+    if (s && pipelined && openInLinks(s)) {
+        /* the remap stage opens the outputs, swaps it in and lets the loader go on */
+        queueSetup(s);
+        return false;
+    }
+#endif
+    if (s && !pipelined && openLinks(s)) {
+        retiredSetup = useSetup(s);
+        Signal(&loader->pr_Task, SIGBREAKF_CTRL_F);
+        return true;
+    }
+    printf("*** reload failed, keeping the current setup\n");
+    retiredSetup = s;
+    Signal(&loader->pr_Task, SIGBREAKF_CTRL_F);
+    return false;
 }
 
 /**************************************************************************/
 
+void waitLoader(void) {
+    /* lets a reload in progress run to completion */
+    while (loaderState != LOADER_IDLE) {
+        Wait(1L << loaderSig);
+        swapReloaded();
+    }
+}
+
+/**************************************************************************/
+
+static uint32 linkSignals(void) {
+    /* signal bits of all input links */
+    uint32 bits = 0;
+    sint32 i;
+    for (i = 0; i < numInLinks; i++) {
+        bits |= 1L << inLinks[i].dest->DestPort->mp_SigBit;
+    }
+    return bits;
+}
+
+static void drainInputs(void) {
+    /* remaps every packet waiting on any input link */
+    struct MidiPacket* packet;
+    sint32 i;
+    for (i = 0; i < numInLinks; i++) {
+        while (packet = GetMidiPacket(inLinks[i].dest)) {
+            if (!stampPacket(packet->MidiMsg[0])) {
+                flushOutput();
+                stampPacket(packet->MidiMsg[0]);
+            }
+            processPacket(packet, i);
+            //showPacket(packet);
+            FreeMidiPacket(packet);
+        }
+    }
+    flushOutput();
+    if (capturing) {
+        flushCapture();
+    }
+}
+
 void processMessages(void) {
-    struct MidiPacket* packet = 0;
-    uint32 flags = SIGBREAKF_CTRL_C | (1L << dest->DestPort->mp_SigBit);
+    uint32 reload = 1L << loaderSig;
+    uint32 flags  = SIGBREAKF_CTRL_C | SIGBREAKF_CTRL_D | SIGBREAKF_CTRL_E | reload;
+    uint32 got;
 
     /* change the task priority for message processing */
     sint32 oldPri = SetTaskPri(FindTask(0), 20);
-    while (!(Wait(flags) & SIGBREAKF_CTRL_C)) {
-        while (packet = GetMidiPacket(dest)) {
-            processPacket(packet);
-            //showPacket(packet);
-            FreeMidiPacket(packet);
+    while (!((got = Wait(flags | linkSignals())) & SIGBREAKF_CTRL_C)) {
+        if (got & reload) {
+            /* new setup ready, swap it in between packets */
+            if (swapReloaded()) {
+                if (capturing) {
+                    captureRecord(CAPTURE_RELOAD, 0, 0, 0, 0);
+                }
+                initChannels();
+            }
         }
+        if (got & SIGBREAKF_CTRL_D) {
+            startReload();
+        }
+        if (got & SIGBREAKF_CTRL_E) {
+            printStats();
+            printTraffic(&traffic);
+        }
+        drainInputs();
     }
     /* Here we must have had a CTRL C, but it is possible there are packets left*/
-    while (packet = GetMidiPacket(dest)) {
-        processPacket(packet);
-        //showPacket(packet);
-        FreeMidiPacket(packet);
-    }
+    drainInputs();
+    /* let go of anything still sounding */
+    releaseHeldNotes();
+    printStats();
+    printTraffic(&traffic);
     /* restore the old priority */
     SetTaskPri(FindTask(0), oldPri);
 }
 
 /**************************************************************************/
 
-void initChannels(void) {
-    sint32 i, j;
-    uint8  initBuffer[4];
-    for (i = 0; i < MIDI_NUM_CHANNELS; i++) {
-        if (channels[i].controlInit) {
-            for (j = 0; j<MIDI_NUM_CONTROLLERS; j++) {
-                if (channels[i].controlInit[j] < 0x80) {
-                    initBuffer[0] = MS_CTRL | channels[i].output;
-                    initBuffer[1] = j;
-                    initBuffer[2] = channels[i].controlInit[j];
-                    PutMidiStream(source, dummyFill, initBuffer, 3, 3);
+/*
+    REPLAY mode
+
+    Pushes the packets of a capture log through processPacket() again, with
+    links that only carry names, and compares what each output link is sent
+    with what was recorded on it. Output is compared as one byte stream per
+    link, so it does not matter where either run happened to flush. Reloads
+    are repeated from the config file at the same point.
+*/
+#define REPLAY_WINDOW  65536 /* bytes one side may run ahead by */
+#define REPLAY_PACKET  CAPTURE_MAX_RECORD /* longest packet nextRecord() reads */
+#define REPLAY_REPORTS 10
+
+typedef struct {
+    uint8* ahead;                                 /* bytes not yet compared */
+    uint32 pos, len;
+    uint32 offset;                                /* bytes compared so far */
+    sint32 side;                                  /* side that is ahead */
+} ReplayStream;
+
+static ReplayStream replayStreams[LINK_MAX];
+static uint32       replayDiffs;
+static uint32       replayLost;
+
+static void replayOutput(sint32 link, sint32 side, const uint8* buf, sint32 len) {
+    /* compares the bytes one side sent on a link with those of the other */
+    ReplayStream* rs = &replayStreams[link];
+    if (rs->len && rs->side != side) {
+        sint32       n = len < (sint32)rs->len ? len : (sint32)rs->len;
+        const uint8* a = rs->ahead + rs->pos;
+        sint32       i;
+        for (i = 0; i < n; i++) {
+            if (a[i] != buf[i] && replayDiffs++ < REPLAY_REPORTS) {
+                printf(
+                    "*** %s byte %lu: recorded %02X, remapped %02X\n", outLinks[link]->name,
+                    (unsigned long)(rs->offset + i), side ? a[i] : buf[i], side ? buf[i] : a[i]
+                );
+            }
+        }
+        rs->offset += n;
+        rs->pos    += n;
+        rs->len    -= n;
+        buf        += n;
+        len        -= n;
+    }
+    if (!len) {
+        return;
+    }
+    if (!rs->ahead && !(rs->ahead = (uint8*)AllocMem(REPLAY_WINDOW, MEMF_PUBLIC))) {
+        replayLost += len;
+        return;
+    }
+    if (!rs->len) {
+        rs->side = side;
+        rs->pos  = 0;
+    }
+    else if (rs->pos + rs->len + len > REPLAY_WINDOW) {
+        memmove(rs->ahead, rs->ahead + rs->pos, rs->len);
+        rs->pos = 0;
+    }
+    if (rs->len + len > REPLAY_WINDOW) {
+        if (!replayLost) {
+            printf("*** %s: output out of step by more than %d bytes\n", outLinks[link]->name, REPLAY_WINDOW);
+        }
+        replayLost += len;
+        return;
+    }
+    memcpy(rs->ahead + rs->pos + rs->len, buf, len);
+    rs->len += len;
+}
+
+static void replayWait(float64 ticks, uint32 start) {
+    /* waits until ticks of the E-clock have passed since start */
+    uint32 rate = stampRate();
+    float64 left;
+    while ((left = ticks - (uint32)(readStamp() - start)) > 0) {
+        if (left > rate / 25) {
+            Delay(1);
+        }
+    }
+}
+
+bool replayCapture(const char* fName, bool timed) {
+    /* replays a log through the loaded setup, true if it was read whole and the output matched */
+    static sint8       inMap[256], outMap[256];
+    CaptureReader      cr;
+    struct MidiPacket* packet;
+    char               name[PORT_NAME];
+    uint32             records = 0, packets = 0, bytes = 0, first = 0, start;
+    sint32             kind = 1, i;
+    bool               started = false;
+    if (!openReplay(&cr, fName)) {
+        return false;
+    }
+    if (!(packet = (struct MidiPacket*)AllocMem(sizeof(struct MidiPacket) + REPLAY_PACKET, MEMF_PUBLIC | MEMF_CLEAR))) {
+        puts("*** unable to allocate replay packet");
+        closeReplay(&cr);
+        return false;
+    }
+    openStats();
+    if (timed && (!stampRate() || !cr.rate)) {
+        puts("*** timed replay needs the E-clock, replaying as fast as possible");
+        timed = false;
+    }
+    runningStatus = (cr.flags & CAPTURE_RUNNINGSTATUS) != 0;
+    replaying     = true;
+    replayDiffs   = 0;
+    replayLost    = 0;
+    memset(inMap, -1, sizeof(inMap));
+    memset(outMap, -1, sizeof(outMap));
+    if (openLinks(setup)) {
+        initChannels();
+        start = readStamp();
+        while (kind > 0 && (kind = nextRecord(&cr)) > 0) {
+            records++;
+            switch (kind) {
+                case CAPTURE_INLINK:
+                case CAPTURE_OUTLINK:
+                    i = cr.len < PORT_NAME ? cr.len : PORT_NAME - 1;
+                    memcpy(name, cr.data, i);
+                    name[i] = 0;
+                    if (kind == CAPTURE_INLINK) {
+                        inMap[cr.link] = inLink(name);
+                    }
+                    else {
+                        outMap[cr.link] = outLink(name);
+                    }
+                    break;
+                case CAPTURE_IN:
+                    if (inMap[cr.link] < 0) {
+                        break;
+                    }
+                    if (timed) {
+                        if (!started) {
+                            first = cr.stamp;
+                            start = readStamp();
+                        }
+                        replayWait((float64)(uint32)(cr.stamp - first) * stampRate() / cr.rate, start);
+                    }
+                    started        = true;
+                    packet->Type   = cr.type;
+                    packet->Length = cr.len;
+                    memcpy(packet->MidiMsg, cr.data, cr.len);
+                    processPacket(packet, inMap[cr.link]);
+                    flushOutput();
+                    packets++;
+                    break;
+                case CAPTURE_OUT:
+                    if (outMap[cr.link] >= 0) {
+                        replayOutput(outMap[cr.link], REPLAY_RECORDED, cr.data, cr.len);
+                        bytes += cr.len;
+                    }
+                    break;
+                case CAPTURE_RELOAD: {
+                    Setup* s = loadSetup(cfgFile);
+                    if (s && openLinks(s)) {
+                        freeSetup(useSetup(s));
+                        initChannels();
+                    }
+                    else {
+                        printf("*** reload failed, keeping the current setup\n");
+                        if (s) {
+                            freeSetup(s);
+                        }
+                    }
+                    break;
+                }
+            }
+        }
+        if (kind < 0) {
+            printf("*** %s is damaged after record %lu\n", fName, (unsigned long)records);
+        }
+        /* the recording ends with the notes let go at exit */
+        releaseHeldNotes();
+        if (stampRate()) {
+            float64 secs = (uint32)(readStamp() - start) / (float64)stampRate();
+            printf(
+                "replayed %lu packets in %.3fs, %.0f packets/s\n",
+                (unsigned long)packets, secs, secs > 0 ? packets / secs : 0.0
+            );
+        }
+        for (i = 0; i < numOutLinks; i++) {
+            ReplayStream* rs = &replayStreams[i];
+            if (rs->len) {
+                printf(
+                    "*** %s: %lu bytes %s\n", outLinks[i]->name, (unsigned long)rs->len,
+                    rs->side == REPLAY_RECORDED ? "recorded but not remapped" : "remapped but not recorded"
+                );
+                replayLost += rs->len;
+            }
+        }
+        printf(
+            "%lu records, %lu bytes recorded: %s\n", (unsigned long)records, (unsigned long)bytes,
+            replayDiffs || replayLost ? "output differs" : "output matches"
+        );
+    }
+    else {
+        kind = -1;
+    }
+    for (i = 0; i < LINK_MAX; i++) {
+        if (replayStreams[i].ahead) {
+            FreeMem(replayStreams[i].ahead, REPLAY_WINDOW);
+            replayStreams[i].ahead = 0;
+        }
+        replayStreams[i].len = 0;
+    }
+    replaying = false;
+    closeReplay(&cr);
+    FreeMem(packet, sizeof(struct MidiPacket) + REPLAY_PACKET);
+    return kind >= 0 && !replayDiffs && !replayLost;
+}
+
+#ifdef MIDIMAPPER_HOST
+#include <ring.h>
+
+/*
+    PIPELINE mode, host build only
+
+    The main task only receives: it stamps each packet and passes it to a
+    remap process through a ring. The remap process runs processPacket()
+    as usual, but its flushes go as byte records through a second ring to
+    a send process, which does the writing. A slow write then holds up
+    only the send process, until the rings fill. Rings are allocated when
+    the pipeline starts; nothing on the way through allocates or locks.
+
+    When the input ring is full the main task waits for room, or with
+    DROPREALTIME or DROPCC drops realtime or controller packets instead.
+    Dropping happens before remapping, so the controller record stays
+    true to what the receiver has.
+*/
+#define PIPE_RECORDS      256 /* per ring, a power of two */
+#define PIPE_DATA         240 /* bytes per output record */
+#define PIPE_STAMPS       64  /* packets remapped per latency record batch */
+
+#define EV_PACKET         0
+#define EV_SETUP          1
+#define EV_DATA           2
+#define EV_STAMP          3
+#define EV_STOP           4
+
+#define FULL_BLOCK        0
+#define FULL_DROPREALTIME 1
+#define FULL_DROPCC       2
+
+typedef struct {
+    struct MidiPacket* packet;                    /* EV_PACKET */
+    Setup*             setup;                     /* EV_SETUP */
+    uint32             stamp;                     /* arrival */
+    uint8              type;
+    uint8              link;                      /* input link */
+} InEvent;
+
+typedef struct {
+    uint32 stamp;                                 /* EV_STAMP arrival */
+    uint16 len;
+    uint8  type;
+    uint8  link;                                  /* EV_DATA output link, EV_STAMP status */
+    uint8  data[PIPE_DATA];
+} OutEvent;
+
+static Ring            inRing;
+static Ring            outRing;
+static bool            pipeline      = false;      /* PIPELINE option */
+static sint32          fullPolicy    = FULL_BLOCK;
+static uint32          dropped       = 0;
+static sint32          pipeSig       = -1;
+static volatile sint32 stagesRunning = 0;
+
+/* packets remapped since the last flush, remap process only */
+static uint32          pipeStamp[PIPE_STAMPS];
+static uint8           pipeStatus[PIPE_STAMPS];
+static sint32          numStamps = 0;
+
+/* counters of the remap process, a copy of them once it has stopped */
+static Traffic                 stoppedTraffic;
+static const Traffic* volatile pipeTraffic = &stoppedTraffic;
+
+/**************************************************************************/
+
+static InEvent* claimIn(void) {
+    InEvent* ev;
+    sint32   spins = 0;
+    while (!(ev = (InEvent*)ringClaim(&inRing))) {
+        ringIdle(&spins);
+    }
+    return ev;
+}
+
+static OutEvent* claimOut(void) {
+    OutEvent* ev;
+    sint32    spins = 0;
+    while (!(ev = (OutEvent*)ringClaim(&outRing))) {
+        ringIdle(&spins);
+    }
+    return ev;
+}
+
+static void queueOutput(OutLink* l, const uint8* buf, sint32 len) {
+    /* remap process: passes bytes for a link on to the send process */
+    while (len > 0) {
+        OutEvent* ev = claimOut();
+        sint32    n  = len < PIPE_DATA ? len : PIPE_DATA;
+        ev->type = EV_DATA;
+        ev->link = l->index;
+        ev->len  = n;
+        memcpy(ev->data, buf, n);
+        ringPublish(&outRing);
+        buf += n;
+        len -= n;
+    }
+}
+
+static void queueStamps(void) {
+    /* remap process: follows a flush with the arrival of the packets it covers */
+    sint32 i;
+    for (i = 0; i < numStamps; i++) {
+        OutEvent* ev = claimOut();
+        ev->type  = EV_STAMP;
+        ev->link  = pipeStatus[i];
+        ev->stamp = pipeStamp[i];
+        ringPublish(&outRing);
+    }
+    numStamps = 0;
+}
+
+static void queueSetup(Setup* s) {
+    /* main task: a reloaded setup goes in line with the packets */
+    InEvent* ev = claimIn();
+    ev->type  = EV_SETUP;
+    ev->setup = s;
+    ringPublish(&inRing);
+}
+
+static void stageDone(void) {
+    /* the signal may be freed as soon as the count reaches 0 */
+    uint32 done = 1L << pipeSig;
+    __atomic_sub_fetch(&stagesRunning, 1, __ATOMIC_RELEASE);
+    Signal(mainTask, done);
+}
+
+/**************************************************************************/
+
+void remapStage(void) {
+    /* remap process entry, runs until EV_STOP */
+    bool   pending = false;
+    sint32 spins   = 0;
+    pipeTraffic = &traffic;
+    for (;;) {
+        InEvent* ev = (InEvent*)ringFront(&inRing);
+        if (!ev) {
+            /* caught up, send what has been remapped */
+            if (pending) {
+                flushOutput();
+                pending = false;
+            }
+            ringIdle(&spins);
+            continue;
+        }
+        spins = 0;
+        if (ev->type == EV_STOP) {
+            ringRelease(&inRing);
+            break;
+        }
+        if (ev->type == EV_SETUP) {
+            if (openOutLinks(ev->setup)) {
+                retiredSetup = useSetup(ev->setup);
+                initChannels();
+            }
+            else {
+                printf("*** reload failed, keeping the current setup\n");
+                retiredSetup = ev->setup;
+            }
+            Signal(&loader->pr_Task, SIGBREAKF_CTRL_F);
+        }
+        else {
+            if (numStamps == PIPE_STAMPS) {
+                flushOutput();
+            }
+            pipeStamp[numStamps]    = ev->stamp;
+            pipeStatus[numStamps++] = ev->packet->MidiMsg[0];
+            processPacket(ev->packet, ev->link);
+            FreeMidiPacket(ev->packet);
+            pending = true;
+        }
+        ringRelease(&inRing);
+    }
+    flushOutput();
+    /* let go of anything still sounding */
+    releaseHeldNotes();
+    claimOut()->type = EV_STOP;
+    ringPublish(&outRing);
+    stoppedTraffic = traffic;
+    pipeTraffic    = &stoppedTraffic;
+    stageDone();
+}
+
+/**************************************************************************/
+
+void sendStage(void) {
+    /* send process entry, runs until EV_STOP */
+    bool   stamped = false;
+    sint32 spins   = 0;
+    for (;;) {
+        OutEvent* ev = (OutEvent*)ringFront(&outRing);
+        if (!ev) {
+            if (stamped) {
+                recordLatency();
+                stamped = false;
+            }
+            ringIdle(&spins);
+            continue;
+        }
+        spins = 0;
+        if (ev->type == EV_STOP) {
+            ringRelease(&outRing);
+            break;
+        }
+        if (ev->type == EV_DATA) {
+            PutMidiStream(outLinks[ev->link]->source, dummyFill, ev->data, ev->len, ev->len);
+        }
+        else {
+            if (!stampPacketAt(ev->link, ev->stamp)) {
+                recordLatency();
+                stampPacketAt(ev->link, ev->stamp);
+            }
+            stamped = true;
+        }
+        ringRelease(&outRing);
+    }
+    recordLatency();
+    stageDone();
+}
+
+/**************************************************************************/
+
+static void receivePacket(struct MidiPacket* packet, sint32 link) {
+    /* main task: hands a packet to the remap process */
+    InEvent* ev;
+    uint32   stamp = readStamp();
+    sint32   spins = 0;
+    while (!(ev = (InEvent*)ringClaim(&inRing))) {
+        if ((fullPolicy == FULL_DROPREALTIME && packet->Type == MMF_REALTIME) ||
+            (fullPolicy == FULL_DROPCC && packet->Type == MMF_CTRL)) {
+            FreeMidiPacket(packet);
+            dropped++;
+            return;
+        }
+        ringIdle(&spins);
+    }
+    ev->type   = EV_PACKET;
+    ev->packet = packet;
+    ev->link   = link;
+    ev->stamp  = stamp;
+    ringPublish(&inRing);
+}
+
+static void receiveInputs(void) {
+    struct MidiPacket* packet;
+    sint32 i;
+    for (i = 0; i < numInLinks; i++) {
+        while (packet = GetMidiPacket(inLinks[i].dest)) {
+            receivePacket(packet, i);
+        }
+    }
+}
+
+/**************************************************************************/
+
+bool startStage(void (*entry)(void), const char* name) {
+    __atomic_add_fetch(&stagesRunning, 1, __ATOMIC_RELEASE);
+    if (!CreateNewProcTags(NP_Entry, entry, NP_Name, name, NP_Priority, 20L, TAG_DONE)) {
+        __atomic_sub_fetch(&stagesRunning, 1, __ATOMIC_RELEASE);
+        printf("*** couldn't start %s\n", name);
+        return false;
+    }
+    return true;
+}
+
+void runPipeline(void) {
+    /* processMessages() with remapping and sending in processes of their own */
+    uint32 reload = 1L << loaderSig;
+    uint32 flags  = SIGBREAKF_CTRL_C | SIGBREAKF_CTRL_D | SIGBREAKF_CTRL_E | reload;
+    uint32 got;
+    sint32 oldPri;
+
+    if ((pipeSig = AllocSignal(-1)) == -1 ||
+        !ringInit(&inRing, PIPE_RECORDS, sizeof(InEvent)) ||
+        !ringInit(&outRing, PIPE_RECORDS, sizeof(OutEvent))) {
+        printf("*** couldn't set up the pipeline\n");
+    }
+    else {
+        pipelined = true;
+        if (startStage(sendStage, "midimapper send")) {
+            if (startStage(remapStage, "midimapper remap")) {
+                oldPri = SetTaskPri(FindTask(0), 20);
+                while (!((got = Wait(flags | linkSignals())) & SIGBREAKF_CTRL_C)) {
+                    if (got & reload) {
+                        swapReloaded();
+                    }
+                    if (got & SIGBREAKF_CTRL_D) {
+                        startReload();
+                    }
+                    if (got & SIGBREAKF_CTRL_E) {
+                        printStats();
+                        printTraffic(pipeTraffic);
+                    }
+                    receiveInputs();
                 }
+                receiveInputs();
+                SetTaskPri(FindTask(0), oldPri);
+                claimIn()->type = EV_STOP;
+                ringPublish(&inRing);
+            }
+            else {
+                claimOut()->type = EV_STOP;
+                ringPublish(&outRing);
+            }
+        }
+        /* both processes are done with the rings once they have signalled */
+        while (__atomic_load_n(&stagesRunning, __ATOMIC_ACQUIRE)) {
+            Wait(1L << pipeSig);
+        }
+        pipelined = false;
+        printf("pipeline dropped %lu packets\n", (unsigned long)dropped);
+        printStats();
+        printTraffic(pipeTraffic);
+    }
+    ringFree(&outRing);
+    ringFree(&inRing);
+    if (pipeSig != -1) {
+        FreeSignal(pipeSig);
+        pipeSig = -1;
+    }
+}
+#endif
+
+/**************************************************************************/
+
+#define STREAM_BUFFER 4096
+
+bool remapStreamFile(const char* inName, const char* outName) {
+    /* remaps a raw MIDI byte stream file in bulk, without midi.library */
+    static uint8 sBuf[STREAM_BUFFER];
+    static uint8 dBuf[STREAM_BUFFER * 4];
+    RemapStream  rs;
+    uint8        status = 0;
+    FILE*        in;
+    FILE*        out;
+    sint32       sLen;
+    uint32       total = 0;
+    if (!(in = fopen(inName, "rb"))) {
+        printf("*** unable to open %s\n", inName);
+        return false;
+    }
+    if (!(out = fopen(outName, "wb"))) {
+        printf("*** unable to create %s\n", outName);
+        fclose(in);
+        return false;
+    }
+    initRemapStream(&rs);
+    clearShadow();
+    while ((sLen = fread(sBuf, 1, STREAM_BUFFER, in)) > 0) {
+        uint8* s = sBuf;
+        while (sLen) {
+            sint32 used = sLen;
+            sint32 dLen = remapMIDIStream(&rs, dBuf, sizeof(dBuf), s, &used);
+            if (runningStatus) {
+                dLen = compressRunningStatus(&status, dBuf, dLen);
             }
+            fwrite(dBuf, 1, dLen, out);
+            s     += used;
+            sLen  -= used;
+            total += used;
         }
     }
+    fclose(out);
+    fclose(in);
+    printf("remapped %lu bytes from %s to %s\n", (unsigned long)total, inName, outName);
+    return true;
+}
+
+/**************************************************************************/
+
+bool matchKeyword(const char* arg, const char* keyword) {
+    /* case insensitive command line keyword match */
+    while (*arg && (*arg | 0x20) == (*keyword | 0x20)) {
+        arg++;
+        keyword++;
+    }
+    return *arg == *keyword;
 }
 
 /**************************************************************************/
 
 int main(int arg_n, char** arg_v) {
-    const char* cfgFile;
+    const char* captureFile = 0;
+    bool        timed       = false;
+    /* options follow the other arguments */
+    for (; arg_n > 2; arg_n--) {
+        const char* opt = arg_v[arg_n - 1];
+        if (matchKeyword(opt, "RUNNINGSTATUS")) {
+            runningStatus = true;
+        }
+        else if (matchKeyword(opt, "TIMED")) {
+            timed = true;
+        }
+#ifdef MIDIMAPPER_HOST
+        else if (matchKeyword(opt, "PIPELINE") || matchKeyword(opt, "BLOCK")) {
+            pipeline = true;
+        }
+        else if (matchKeyword(opt, "DROPREALTIME")) {
+            pipeline   = true;
+            fullPolicy = FULL_DROPREALTIME;
+        }
+        else if (matchKeyword(opt, "DROPCC")) {
+            pipeline   = true;
+            fullPolicy = FULL_DROPCC;
+        }
+#endif
+        else {
+            break;
+        }
+    }
+    if (arg_n > 1) {
+        cfgFile = arg_v[1];
+    }
+    if (arg_n > 3 && matchKeyword(arg_v[2], "COMPILE")) {
+        /* midimapper <config> COMPILE <image> */
+        bool saved = false;
+        printf("MIDI ReMapper\n");
+        useSetup(loadSetup(cfgFile));
+        if (setup) {
+            saved = saveSetupImage(setup, arg_v[3]);
+        }
+        freeSetup(useSetup(0));
+        return saved ? RETURN_OK : RETURN_FAIL;
+    }
+    if (arg_n > 4 && matchKeyword(arg_v[2], "STREAM")) {
+        /* midimapper <config> STREAM <in> <out> */
+        printf("MIDI ReMapper\n");
+        useSetup(loadSetup(cfgFile));
+        if (setup) {
+            remapStreamFile(arg_v[3], arg_v[4]);
+        }
+        freeSetup(useSetup(0));
+        return 0;
+    }
+    if (arg_n > 4 && matchKeyword(arg_v[2], "SMF")) {
+        /* midimapper <config> SMF <in.mid> <out.mid> */
+        printf("MIDI ReMapper\n");
+        useSetup(loadSetup(cfgFile));
+        if (setup) {
+            remapSMFFile(arg_v[3], arg_v[4], runningStatus);
+        }
+        freeSetup(useSetup(0));
+        return 0;
+    }
+    if (arg_n > 2 && matchKeyword(arg_v[2], "BENCH")) {
+        /* midimapper <config> BENCH [messages] */
+        printf("MIDI ReMapper\n");
+        useSetup(loadSetup(cfgFile));
+        if (setup && openStats()) {
+            sint32 count = arg_n > 3 ? atoi(arg_v[3]) : 0;
+            benchBlock(count > 0 ? count : 1000000);
+        }
+        freeSetup(useSetup(0));
+        closeStats();
+        return 0;
+    }
+    if (arg_n > 3 && matchKeyword(arg_v[2], "REPLAY")) {
+        /* midimapper <config> REPLAY <log> [TIMED], warns if the output differs */
+        bool matched = false;
+        printf("MIDI ReMapper\n");
+        useSetup(loadSetup(cfgFile));
+        if (setup) {
+            matched = replayCapture(arg_v[3], timed);
+        }
+        freeSetup(useSetup(0));
+        closeLinks();
+        closeStats();
+        return matched ? RETURN_OK : RETURN_WARN;
+    }
+    if (arg_n > 3 && matchKeyword(arg_v[2], "CAPTURE")) {
+        /* midimapper <config> CAPTURE <log>, then runs as usual */
+        captureFile = arg_v[3];
+#ifdef MIDIMAPPER_HOST
+        if (pipeline) {
+            printf("*** CAPTURE does not run with PIPELINE\n");
+            return 0;
+        }
+#endif
+    }
+#ifdef MIDIMAPPER_HOST
+    if (arg_n > 4 && matchKeyword(arg_v[2], "BATCH")) {
+        /* midimapper <config> BATCH <directory or list> <out directory> [workers] */
+        bool converted = false;
+        printf("MIDI ReMapper\n");
+        useSetup(loadSetup(cfgFile));
+        if (setup) {
+            converted = remapSMFBatch(arg_v[3], arg_v[4], arg_n > 5 ? atoi(arg_v[5]) : 0, runningStatus);
+        }
+        freeSetup(useSetup(0));
+        return converted ? RETURN_OK : RETURN_FAIL;
+    }
+#endif
     if (init() == true) {
         printf("MIDI ReMapper\n");
-        cfgFile = arg_n > 1 ? arg_v[1] : "remap.cfg";
-        if (loadSetup(cfgFile)) {
+        useSetup(loadSetup(cfgFile));
+        if (
+            setup && (!captureFile || openCapture(captureFile, runningStatus ? CAPTURE_RUNNINGSTATUS : 0)) &&
+            openLinks(setup)
+        ) {
             initChannels();
-            printf("\nInitialisation complete: Press CTRL-C to abort\n");
+            printf("\nInitialisation complete: Press CTRL-C to abort, CTRL-D to reload, CTRL-E for statistics\n");
+#ifdef MIDIMAPPER_HOST
+            if (pipeline) {
+                runPipeline();
+            }
+            else
+#endif
             processMessages();
+            waitLoader();
         }
-        freeSetup();
+        closeCapture();
+        freeSetup(useSetup(0));
     }
     done();
     return 0;
@@ -12,6 +12,18 @@
 
 // Types
 #ifdef USE_EXNG_TYPES
+#ifdef MIDIMAPPER_HOST
+/* host build: long is 64-bit on LP64, use exact width types */
+#include <stdint.h>
+typedef uint8_t            uint8;
+typedef uint16_t           uint16;
+typedef uint32_t           uint32;
+typedef uint64_t           uint64;
+typedef int8_t             sint8;
+typedef int16_t            sint16;
+typedef int32_t            sint32;
+typedef int64_t            sint64;
+#else
 typedef unsigned char      uint8;
 typedef unsigned short     uint16;
 typedef unsigned long      uint32;
@@ -20,6 +32,7 @@ typedef signed char        sint8;
 typedef signed short       sint16;
 typedef signed long        sint32;
 typedef signed long long   sint64;
+#endif
 typedef float              float32;
 typedef double             float64;
 typedef enum {
@@ -28,39 +41,403 @@ typedef enum {
 } bool;
 #endif
 
-/* in remap.c */
-bool   loadSetup(const char* configFile);
-void   freeSetup(void);
-sint32 remapMIDIData(uint8* dBuf, uint8* sBuf, sint32 len);
+/*
+    Remap state that each host worker thread keeps for itself, see the
+    BATCH mode. There is only ever one remapping task on the Amiga.
+*/
+#ifdef MIDIMAPPER_HOST
+#define TASK_LOCAL __thread
+#else
+#define TASK_LOCAL
+#endif
 
 typedef struct Table_t Table;
 typedef struct Channel_t Channel;
+typedef struct Setup_t Setup;
+typedef struct PlanTable_t PlanTable;
+typedef struct SysExRule_t SysExRule;
+typedef struct Split_t Split;
+typedef struct BendCurve_t BendCurve;
+typedef struct Port_t Port;
+typedef struct SparseMap_t SparseMap;
 //typedef struct Directive_t Directive;
 
+/* in remap.c */
+typedef struct RemapStream_t RemapStream;
+
+Setup* loadSetup(const char* configFile);
+void   freeSetup(Setup* s);
+Setup* useSetup(Setup* s);
+sint32 remapMIDIData(uint8* dBuf, uint8* sBuf, sint32 len);
+void   countRemap(const uint8* sBuf, const uint8* dBuf, sint32 len);
+sint32 statusDataLength(sint32 status);
+void   initRemapStream(RemapStream* rs);
+sint32 remapMIDIStream(RemapStream* rs, uint8* dBuf, sint32 dLen, uint8* sBuf, sint32* sLen);
+sint32 compressRunningStatus(uint8* running, uint8* buf, sint32 len);
+Split* allocSplit(Setup* s, Channel* c);
+BendCurve* allocBendCurve(Setup* s, Channel* c);
+Port*  allocPort(Setup* s, const char* inName, const char* outName);
+sint32 internTable(Setup* s, const uint8* data);
+const uint8* poolTable(const Setup* s, sint32 index);
+bool   setSparse(Setup* s, SparseMap* m, sint32 key, sint32 table);
+sint32 getSparse(const SparseMap* m, sint32 key);
+
+/* in lexer.c */
+typedef struct Lexer_t Lexer;
+
+bool   openLexer(Lexer* lx, const char* fName);
+void   closeLexer(Lexer* lx);
+bool   nextToken(Lexer* lx);
+bool   expectToken(Lexer* lx, sint32 type, const char* what);
+bool   expectInteger(Lexer* lx, sint32 min, sint32 max, const char* what);
+bool   lexError(Lexer* lx, const char* format, ...);
+
+#define TOK_END              0
+#define TOK_WORD             1
+#define TOK_NUMBER           2                    /* value, fixed */
+#define TOK_PAIR             3                    /* value:value2 */
+#define TOK_LBRACE           4
+#define TOK_RBRACE           5
+
+#define LEX_WORD_SIZE        256
+
+struct Lexer_t {
+    const char* fName;
+    char*       buf;                              /* whole file */
+    uint32      size;
+    const char* pos;
+    const char* end;
+    const char* lineStart;
+    sint32      line;
+    /* current token */
+    sint32      type;
+    sint32      tokLine;
+    sint32      tokCol;
+    sint32      value;
+    sint32      value2;
+    sint32      fixed;                            /* value in 16.16 fixed point */
+    bool        isReal;
+    char        word[LEX_WORD_SIZE];              /* token text */
+};
+
+/* in sysex.c */
+typedef struct {
+    const SysExRule* rule;                        /* rule matched, if any */
+    sint32           pos;                         /* position of the last data byte */
+    uint32           sum;                         /* checksummed bytes so far */
+    uint8            man;                         /* manufacturer ID */
+    uint8            held;                        /* byte held back */
+    bool             holding;
+    bool             plain;                       /* no rule, pass on as is */
+} SysExState;
+
+void   startSysEx(SysExState* sx);
+sint32 sysexData(SysExState* sx, uint8* dBuf, sint32 b);
+sint32 endSysEx(SysExState* sx, uint8* dBuf);
+sint32 remapSysEx(uint8* msg, sint32 len);
+SysExRule* allocSysExRule(Setup* s, sint32 manufacturer, sint32 model);
+
+/* in smf.c */
+bool   remapSMFFile(const char* inName, const char* outName, bool compress);
+#ifdef MIDIMAPPER_HOST
+bool   remapSMFBatch(const char* source, const char* outDir, sint32 workers, bool compress);
+#endif
+
+/* in capture.c */
+#define CAPTURE_IN           1                    /* packet taken from an input link */
+#define CAPTURE_OUT          2                    /* bytes written to an output link */
+#define CAPTURE_INLINK       3                    /* input link opened, cluster name */
+#define CAPTURE_OUTLINK      4                    /* output link opened, cluster name */
+#define CAPTURE_RELOAD       5                    /* reloaded setup swapped in */
+
+#define CAPTURE_RUNNINGSTATUS 0x0001              /* recorded with RUNNINGSTATUS */
+
+#define CAPTURE_RECORD       12                   /* record header bytes */
+#define CAPTURE_MAX_RECORD   65535                /* longest record, a packet's Length is a word */
+
+typedef struct {
+    FILE*  file;
+    uint8* data;                                  /* bytes of the current record */
+    uint32 size;                                  /* allocated for data */
+    uint32 rate;                                  /* E-clock rate of the recording */
+    uint32 stamp;                                 /* current record */
+    uint32 len;
+    uint16 flags;
+    uint16 type;
+    uint8  kind;
+    uint8  link;
+} CaptureReader;
+
+extern bool capturing;
+
+bool   openCapture(const char* fName, uint32 flags);
+void   captureRecord(sint32 kind, sint32 link, sint32 type, const uint8* data, sint32 len);
+void   flushCapture(void);
+void   closeCapture(void);
+bool   openReplay(CaptureReader* cr, const char* fName);
+sint32 nextRecord(CaptureReader* cr);
+void   closeReplay(CaptureReader* cr);
+
+/* in arena.c */
+#define ARENA_BLOCK          8192                 /* block size once the first is full */
+
+typedef struct ArenaBlock_t ArenaBlock;
+
+typedef struct {
+    ArenaBlock* blocks;                           /* newest first */
+    uint32      size;                             /* bytes in all blocks */
+    uint32      used;                             /* high-water mark */
+    sint32      numBlocks;
+} Arena;
+
+void*  arenaAlloc(Arena* a, uint32 size);
+char*  arenaString(Arena* a, const char* s);
+void   reportArena(const Arena* a);
+void   freeArena(Arena* a);
+
+/* in curve.c */
+#define FIX_ONE              0x10000              /* 1.0 in 16.16 fixed point */
+#define CURVE_POINTS         16                   /* points of a points or spline curve */
+
+void   powerCurve(uint8* data, sint32 min, sint32 max, sint32 zeroX, sint32 zeroY, sint32 grad, sint32 power);
+void   pointCurve(uint8* data, const uint8* x, const uint8* y, sint32 n, bool spline);
+bool   kneeCurve(uint8* data, sint32 kneeX, sint32 kneeY, bool log);
+
+/* in block.c */
+#define BLOCK_EVENTS         256                  /* messages per block */
+
+typedef struct {
+    uint8  status[BLOCK_EVENTS];
+    uint8  data1[BLOCK_EVENTS];
+    uint8  data2[BLOCK_EVENTS];                   /* 0 where there is none */
+    uint16 end[BLOCK_EVENTS];                     /* output offset after each message */
+    sint32 count;
+} EventBlock;
+
+typedef struct {
+    const uint8* source[4][16];                   /* tables copied into lut, per slice and channel */
+    uint8  output[16];                            /* output channel per input channel */
+    uint8  lut[5 * 16 * 128 + 4];                 /* key, velocity, controller, pressure, identity */
+    bool   simd;
+} BlockPlan;
+
+void   initBlockPlan(BlockPlan* bp, bool simd);
+sint32 remapBlock(BlockPlan* bp, EventBlock* b, uint8* dBuf);
+bool   benchBlock(sint32 count);
+
+/* in image.c */
+bool   saveSetupImage(Setup* s, const char* fName);
+bool   isSetupImage(const char* fName);
+bool   loadSetupImage(Setup* s, const char* fName);
+void   freeSetupImage(Setup* s);
+
+/* in plan.c */
+bool   compileSetup(Setup* s);
+void   carryChannelState(Channel* to, const Channel* from);
+sint32 releaseNotes(Channel* c, uint8* dBuf);
+sint32 releaseAllNotes(uint8* dBuf);
+void   clearShadow(void);
+void   useShadow(uint8* shadow);
+bool   sendControl(sint32 out, sint32 ctl, sint32 val);
+sint32 releaseKey(Channel* c, uint8* dBuf, sint32 key, sint32 status, sint32 vel);
+
+typedef sint32 (*RemapFunc)(Channel* c, uint8* dBuf, uint8* sBuf, sint32 sLen);
+
 #define MIDI_TABLE_SIZE      128
 #define MIDI_NUM_CONTROLLERS 128
 #define MIDI_NUM_CHANNELS    16
 
+/* in stats.c */
+bool   openStats(void);
+void   closeStats(void);
+bool   stampPacket(sint32 status);
+bool   stampPacketAt(sint32 status, uint32 stamp);
+uint32 readStamp(void);
+uint32 stampRate(void);
+void   recordLatency(void);
+void   printStats(void);
+
+#define STAT_NOTE            0
+#define STAT_CTRL            1
+#define STAT_PROG            2
+#define STAT_REALTIME        3
+#define STAT_OTHER           4
+#define STAT_CLASSES         5
+
+typedef struct {
+    uint32 notes;                                 /* note ons */
+    uint32 progs;                                 /* program changes */
+    uint32 other;                                 /* pressure and pitch bend */
+    uint32 passBytes;                             /* bytes copied without remapping */
+    uint32 ctrls[MIDI_NUM_CONTROLLERS];           /* per controller number */
+} ChannelTraffic;
+
+typedef struct {
+    ChannelTraffic in[MIDI_NUM_CHANNELS];         /* by input channel */
+    ChannelTraffic out[MIDI_NUM_CHANNELS];        /* by output channel */
+    uint32         systemBytes;                   /* system and realtime bytes */
+    uint32         sysexPackets;                  /* SysEx packets passed on */
+    uint32         sysexBytes;
+} Traffic;
+
+extern TASK_LOCAL Traffic traffic;
+
+void   printTraffic(const Traffic* t);
+
+#define SPLIT_MAX            4                    /* splits and layers per input channel */
+
+#define REMAP_MAX_OUTPUT     (MIDI_NUM_CHANNELS * 3) /* most bytes one message can remap to */
+#define REMAP_MAX_RELEASE    (MIDI_NUM_CHANNELS * MIDI_TABLE_SIZE * 3 * (SPLIT_MAX + 1)) /* releaseAllNotes() */
+
+struct RemapStream_t {
+    uint8      status;                            /* running status (0 if none) */
+    uint8      need;                              /* data bytes the status takes */
+    uint8      have;                              /* bytes gathered in msg */
+    uint8      msg[3];                            /* message being gathered */
+    SysExState sysex;                             /* SysEx being passed on */
+};
+
+#define SYSEX_ANY_MODEL      -1
+#define SYSEX_DEVICE         0x01                 /* rewrite the device ID */
+#define SYSEX_CHECKSUM       0x02                 /* recompute a Roland checksum */
+
+struct SysExRule_t {
+    SysExRule* next;
+    sint16     model;                             /* SYSEX_ANY_MODEL or model ID */
+    uint8      manufacturer;
+    uint8      device;                            /* new device ID bits */
+    uint8      deviceMask;                        /* device ID bits replaced */
+    uint8      flags;
+};
+
+#define TABLE_HASH_SIZE      256
+#define TABLE_POOL           256                  /* distinct table contents, index 0 is none */
+#define POOL_HASH_SIZE       64
+
 struct Table_t {
     Table* next;
+    Table* hashNext;                              /* name hash chain */
+    char*  name;
     uint32 idHash;
-    uint8  data[MIDI_TABLE_SIZE];
+    uint8* data;                                  /* contents, pooled once added */
+    uint8  index;                                 /* pool index of the contents */
 };
 
-struct Channel_t {
-    uint8* programMap;                            /* remaps program changes */
-    uint8* progBankMSBMap;                        /* per remapped program bank MSB*/
-    uint8* progBankLSBMap;                        /* per remapped program bank LSB*/
-    uint8* progTransMap;                          /* per remapped program transpose */
-    uint8* noteMap[MIDI_TABLE_SIZE];              /* per remapped program note map (percussion parts) */
-    uint8* velocityMap;                           /* remaps note on velocity */
-    uint8* controlMap;                            /* remaps controller numbers */
-    uint8* controlRangeMap[MIDI_NUM_CONTROLLERS]; /* remaps controller ranges */
-    uint8* controlInit;                           /* initial controller values */
+typedef struct {
+    uint8  key;                                   /* program or controller number */
+    uint8  table;                                 /* pool index */
+} MapEntry;
+
+struct SparseMap_t {
+    MapEntry* entry;                              /* sorted by key, 0 if empty */
+    uint8     count;
+    uint8     size;                               /* entries allocated */
+};
+
+#define BEND_POINTS          16                   /* points of a pitch bend curve */
+#define BEND_KNOTS           129                  /* compiled knots, every 128 bend steps */
+#define BEND_CENTRE          8192
+#define BEND_MAX             16383
+
+struct BendCurve_t {
+    sint32 numPoints;
+    sint32 x[BEND_POINTS];                        /* input bend, ascending */
+    sint32 y[BEND_POINTS];                        /* output bend, clamped when compiled */
+};
+
+struct Split_t {
+    uint8* velTable;                              /* compiled velocity map */
+    uint8  velocityMap;                           /* remaps note on velocity, else the channel's */
     uint8  output;                                /* output channel */
-    sint8  currProgIn;                            /* current program (input) */
-    sint8  currTrans;
-    uint8  currBankLSB;
+    uint8  keyLow, keyHigh;                       /* input key range */
+    uint8  velLow, velHigh;                       /* input velocity range */
+    sint8  transpose;                             /* added after the key map */
+};
+
+struct Channel_t {
+    /* running state and the lookups of every message, together at the front */
+    uint8     output;                             /* output channel */
+    sint8     currProgIn;                         /* current program (input) */
+    uint8     noSuppress;                         /* send repeated controller values */
+    uint8     blockFast;                          /* BLOCK_ messages remapBlock() does inline */
+    uint16    ctrlOuts;                           /* further outputs controllers are copied to */
+    uint8*    keyTable;                           /* fused key map for the current program */
+    uint8*    velTable;                           /* velocity map, 0 stays 0 */
+    uint8*    ctrlTable;                          /* controller number map */
+    uint8*    pressTable;                         /* pressure map */
+    uint8**   plans;                              /* compiled tables of the setup, by plan index */
+    RemapFunc remap[8];                           /* handler per status nybble */
+
+    /* configuration, tables are pool indices, 0 if none */
+    uint8     programMap;                         /* remaps program changes */
+    uint8     progBankMSBMap;                     /* per remapped program bank MSB */
+    uint8     progBankLSBMap;                     /* per remapped program bank LSB */
+    uint8     progTransMap;                       /* per remapped program transpose */
+    uint8     velocityMap;                        /* remaps note on velocity */
+    uint8     controlMap;                         /* remaps controller numbers */
+    uint8     controlInit;                        /* initial controller values */
+    uint8     pressureMap;                        /* remaps channel and poly pressure */
+    uint8     numSplits;
+    SparseMap noteMaps;                           /* per program note maps (percussion parts) */
+    SparseMap rangeMaps;                          /* per controller range maps */
+    BendCurve* bendCurve;                         /* remaps pitch bend, 0 if none */
+    Split*    splits;                             /* SPLIT_MAX splits, 0 if none */
+
+    /* compiled plan, built by compileSetup() */
+    const uint8* progTable;                       /* the program change tables above */
+    const uint8* bankMSBTable;
+    const uint8* bankLSBTable;
+    const uint8* transTable;
+    uint8     progKeys[MIDI_TABLE_SIZE];          /* plan index of the fused key map + transpose per program */
+    uint8     ctrlRange[MIDI_NUM_CONTROLLERS];    /* plan index of the range map per input controller */
+    uint8     keyRoute[MIDI_TABLE_SIZE];          /* splits by input key, one bit each */
+    uint8     velRoute[MIDI_TABLE_SIZE];          /* splits by input velocity */
+    uint16    bendKnots[BEND_KNOTS];              /* bend curve, interpolated between knots */
+
+    /* sounding notes, by input key */
+    uint32    noteBits[MIDI_TABLE_SIZE / 32];     /* keys held */
+    uint8     noteKey[MIDI_TABLE_SIZE];           /* key sent at note on */
+    uint8     noteOut[MIDI_TABLE_SIZE];           /* channel sent at note on */
+    uint8     noteSplits[MIDI_TABLE_SIZE];        /* splits sounding, one bit each */
+    uint8     splitKey[SPLIT_MAX][MIDI_TABLE_SIZE];
+    uint8     splitOut[SPLIT_MAX][MIDI_TABLE_SIZE];
+};
+
+#define BLOCK_NOTES          0x01                 /* no splits, plain note handlers */
+#define BLOCK_CTRL           0x02                 /* remapCtrl() to a single output */
+
+#define PLAN_MAX             256                  /* compiled tables per setup, index 0 is identity */
+
+#define PORT_MAX             8                    /* input/output pairs per setup */
+#define PORT_NAME            32                   /* cluster name size */
+
+struct Port_t {
+    Channel* channels;                            /* MIDI_NUM_CHANNELS channels */
+    char     inName[PORT_NAME];                   /* input cluster */
+    char     outName[PORT_NAME];                  /* output cluster */
+    uint8    in, out;                             /* links, set by the mapper */
+};
+
+struct Setup_t {
+    Arena      arena;                             /* all configuration data */
+    Table*     tableList;                         /* parsed tables */
+    Table*     tableTail;
+    Table*     tableHash[TABLE_HASH_SIZE];        /* named tables by id hash */
+    uint8*     pool[TABLE_POOL];                  /* table contents by index */
+    uint32     poolSum[TABLE_POOL];               /* content hash per index */
+    uint8      poolNext[TABLE_POOL];              /* content hash chain */
+    uint8      poolHash[POOL_HASH_SIZE];
+    sint32     poolSize;                          /* indices used, including 0 */
+    Port       ports[PORT_MAX];
+    sint32     numPorts;
+    Channel*   channels;                          /* channels of the first port */
+    PlanTable* planList;                          /* compiled plan tables */
+    uint8*     plans[PLAN_MAX];                   /* their contents by plan index */
+    sint32     numPlans;                          /* indices used, including 0 */
+    SysExRule* sysexList;                         /* SysEx rules */
+    uint8      sysexMan[128];                     /* manufacturers with a rule */
+    uint8*     image;                             /* setup image, if loaded from one */
+    uint32     imageSize;
 };
 
 #define D_TABLE           0
@@ -0,0 +1,578 @@
+/*
+    Compiled remap plan
+
+    Once the configuration has been parsed it never changes, so rather than
+    testing for each optional table on every message, compileSetup() fuses
+    the tables of each channel into flat, pre-clamped lookups and picks a
+    handler for each status nybble that does only the work that channel
+    needs. A program change just selects the fused key table for the new
+    program.
+
+    A channel with splits has a bit mask per input key and per velocity;
+    a note on goes to every split whose bits are set in both. What was
+    sent for each split is kept with the note so the note off matches it.
+*/
+
+#include "midimapper.h"
+
+extern TASK_LOCAL Channel* channels;
+
+struct PlanTable_t {
+    PlanTable*   next;
+    const uint8* source;    /* table this was built from, 0 for identity */
+    sint32       shift;     /* transpose applied */
+    sint32       kind;
+    uint8        index;     /* in Setup.plans */
+    uint8        data[MIDI_TABLE_SIZE];
+};
+
+#define PLAN_KEYS     0
+#define PLAN_VELOCITY 1
+#define PLAN_CTRL     2
+#define PLAN_DATA     3
+
+static uint8      identity[MIDI_TABLE_SIZE];
+
+/*
+    Last value sent for each controller of each output channel, 0xFF if
+    not known. Shared by all input channels routed to an output, and kept
+    across setup swaps since it describes the receiver, not the setup.
+    With several output links each has its own, selected by useShadow().
+    Host worker threads each select one of their own.
+*/
+static uint8      defaultShadow[MIDI_NUM_CHANNELS][MIDI_NUM_CONTROLLERS];
+static TASK_LOCAL uint8 (*ctrlShadow)[MIDI_NUM_CONTROLLERS] = defaultShadow;
+
+/**************************************************************************/
+
+static sint32 planIndex(Setup* s, const uint8* source, sint32 shift, sint32 kind) {
+    /* finds or builds a fused, clamped table; its plan index, -1 if none */
+    PlanTable* t;
+    sint32     i;
+    if (!source && !shift) {
+        return 0;
+    }
+    for (t = s->planList; t; t = t->next) {
+        if (t->source == source && t->shift == shift && t->kind == kind) {
+            return t->index;
+        }
+    }
+    if (s->numPlans == PLAN_MAX) {
+        printf("*** more than %ld different compiled tables\n", (long)PLAN_MAX - 1);
+        return -1;
+    }
+    if (!(t = (PlanTable*)arenaAlloc(&s->arena, sizeof(PlanTable)))) {
+        return -1;
+    }
+    for (i = 0; i < MIDI_TABLE_SIZE; i++) {
+        sint32 v = source ? source[i] : i;
+        if (kind == PLAN_CTRL && !v) {
+            /* zero entries leave the controller number alone */
+            v = i;
+        }
+        v += shift;
+        t->data[i] = v < 0 ? 0 : v > 127 ? 127 : v;
+    }
+    if (kind == PLAN_VELOCITY) {
+        /* note on with zero velocity is a note off */
+        t->data[0] = 0;
+    }
+    t->source = source;
+    t->shift  = shift;
+    t->kind   = kind;
+    t->index  = s->numPlans;
+    t->next     = s->planList;
+    s->planList = t;
+    s->plans[s->numPlans++] = t->data;
+    return t->index;
+}
+
+static uint8* planTable(Setup* s, const uint8* source, sint32 shift, sint32 kind) {
+    /* the table itself, 0 if none */
+    sint32 i = planIndex(s, source, shift, kind);
+    return i < 0 ? 0 : s->plans[i];
+}
+
+/**************************************************************************/
+
+void useShadow(uint8* shadow) {
+    /* selects the record of the output link about to be written, 0 for the default */
+    ctrlShadow = shadow ? (uint8 (*)[MIDI_NUM_CONTROLLERS])shadow : defaultShadow;
+}
+
+void clearShadow(void) {
+    /* forgets all controller values sent on the selected output link */
+    sint32 i, j;
+    for (i = 0; i < MIDI_NUM_CHANNELS; i++) {
+        for (j = 0; j < MIDI_NUM_CONTROLLERS; j++) {
+            ctrlShadow[i][j] = 0xFF;
+        }
+    }
+}
+
+bool sendControl(sint32 out, sint32 ctl, sint32 val) {
+    /* false if the receiver already has this controller value */
+    sint32 i;
+    switch (ctl) {
+        case 6:  case 38: /* data entry */
+        case 96: case 97: /* data increment, decrement */
+            return true;
+        case 121:
+            /* reset all controllers */
+            for (i = 0; i < MIDI_NUM_CONTROLLERS; i++) {
+                ctrlShadow[out][i] = 0xFF;
+            }
+            return true;
+    }
+    if (ctl >= 120) {
+        /* channel mode messages always act */
+        return true;
+    }
+    if (ctrlShadow[out][ctl] == val) {
+        return false;
+    }
+    ctrlShadow[out][ctl] = val;
+    return true;
+}
+
+/**************************************************************************/
+
+static sint32 remapCopy(Channel* c, uint8* dBuf, uint8* sBuf, sint32 sLen) {
+    sint32 i;
+    if (sBuf[0] < MS_SYSEX) {
+        /* copied as is, so out on the same channel */
+        traffic.in[sBuf[0] & 0x0F].passBytes  += sLen;
+        traffic.out[sBuf[0] & 0x0F].passBytes += sLen;
+    }
+    else {
+        traffic.systemBytes += sLen;
+    }
+    for (i = 0; i < sLen; i++) {
+        dBuf[i] = sBuf[i];
+    }
+    return sLen;
+}
+
+sint32 releaseKey(Channel* c, uint8* dBuf, sint32 key, sint32 status, sint32 vel) {
+    /* note offs for whatever was sent at note on for an input key */
+    uint32  bit   = 1UL << (key & 31);
+    uint32* bits  = &c->noteBits[key >> 5];
+    uint32  route = c->noteSplits[key];
+    sint32  i = 0, j;
+    if (*bits & bit) {
+        *bits    &= ~bit;
+        dBuf[i++] = status | c->noteOut[key];
+        dBuf[i++] = c->noteKey[key];
+        dBuf[i++] = vel;
+    }
+    c->noteSplits[key] = 0;
+    for (j = 0; route; j++, route >>= 1) {
+        if (route & 1) {
+            dBuf[i++] = status | c->splitOut[j][key];
+            dBuf[i++] = c->splitKey[j][key];
+            dBuf[i++] = vel;
+        }
+    }
+    return i;
+}
+
+static sint32 remapNoteOff(Channel* c, uint8* dBuf, uint8* sBuf, sint32 sLen) {
+    /* releases the keys that were sent at note on, whatever has changed since */
+    sint32 key = sBuf[1];
+    sint32 i   = releaseKey(c, dBuf, key, sBuf[0] & 0xF0, c->velTable[sBuf[2]]);
+    if (i || c->numSplits) {
+        return i;
+    }
+    /* not sounding, pass it on through the current maps */
+    dBuf[0] = (sBuf[0] & 0xF0) | c->output;
+    dBuf[1] = c->keyTable[key];
+    dBuf[2] = c->velTable[sBuf[2]];
+    return 3;
+}
+
+static sint32 remapNoteOn(Channel* c, uint8* dBuf, uint8* sBuf, sint32 sLen) {
+    sint32 key = sBuf[1];
+    sint32 i;
+    if (!sBuf[2]) {
+        return remapNoteOff(c, dBuf, sBuf, sLen);
+    }
+    /* retriggered before its note off: release what was sent */
+    i = releaseKey(c, dBuf, key, MS_NOTEOFF, 0);
+    c->noteBits[key >> 5] |= 1UL << (key & 31);
+    c->noteKey[key] = dBuf[i + 1] = c->keyTable[key];
+    c->noteOut[key] = c->output;
+    dBuf[i]         = MS_NOTEON | c->output;
+    dBuf[i + 2]     = c->velTable[sBuf[2]];
+    return i + 3;
+}
+
+static sint32 remapSplitOn(Channel* c, uint8* dBuf, uint8* sBuf, sint32 sLen) {
+    /* sends a note on to every split the key and velocity fall in */
+    sint32 key = sBuf[1];
+    sint32 vel = sBuf[2];
+    sint32 i, j;
+    uint32 route;
+    if (!vel) {
+        return remapNoteOff(c, dBuf, sBuf, sLen);
+    }
+    i     = releaseKey(c, dBuf, key, MS_NOTEOFF, 0);
+    route = c->noteSplits[key] = c->keyRoute[key] & c->velRoute[vel];
+    for (j = 0; route; j++, route >>= 1) {
+        if (route & 1) {
+            const Split* sp = &c->splits[j];
+            sint32       k  = c->keyTable[key] + sp->transpose;
+            k = k < 0 ? 0 : k > 127 ? 127 : k;
+            c->splitKey[j][key] = dBuf[i + 1] = k;
+            c->splitOut[j][key] = sp->output;
+            dBuf[i]     = MS_NOTEON | sp->output;
+            dBuf[i + 2] = sp->velTable[vel];
+            i += 3;
+        }
+    }
+    return i;
+}
+
+static sint32 remapCtrl(Channel* c, uint8* dBuf, uint8* sBuf, sint32 sLen) {
+    sint32 ctl = c->ctrlTable[sBuf[1]];
+    sint32 val = c->plans[c->ctrlRange[sBuf[1]]][sBuf[2]];
+    sint32 i   = 0;
+    uint32 outs;
+    sint32 out;
+    if (c->ctrlOuts) {
+        /* splits on other outputs get the controller too */
+        outs = c->ctrlOuts | (1UL << c->output);
+        for (out = 0; outs; out++, outs >>= 1) {
+            if ((outs & 1) && (c->noSuppress || sendControl(out, ctl, val))) {
+                dBuf[i++] = MS_CTRL | out;
+                dBuf[i++] = ctl;
+                dBuf[i++] = val;
+            }
+        }
+        return i;
+    }
+    if (!c->noSuppress && !sendControl(c->output, ctl, val)) {
+        return 0;
+    }
+    dBuf[0] = MS_CTRL | c->output;
+    dBuf[1] = ctl;
+    dBuf[2] = val;
+    return 3;
+}
+
+static sint32 remapPolyPress(Channel* c, uint8* dBuf, uint8* sBuf, sint32 sLen) {
+    /* pressure goes to the keys that were sent at note on */
+    sint32  key   = sBuf[1];
+    sint32  val   = c->pressTable[sBuf[2]];
+    uint32  route = c->noteSplits[key];
+    sint32  i = 0, j;
+    if (c->noteBits[key >> 5] & (1UL << (key & 31))) {
+        dBuf[i++] = MS_POLYPRESS | c->noteOut[key];
+        dBuf[i++] = c->noteKey[key];
+        dBuf[i++] = val;
+    }
+    for (j = 0; route; j++, route >>= 1) {
+        if (route & 1) {
+            dBuf[i++] = MS_POLYPRESS | c->splitOut[j][key];
+            dBuf[i++] = c->splitKey[j][key];
+            dBuf[i++] = val;
+        }
+    }
+    if (i || c->numSplits) {
+        return i;
+    }
+    dBuf[0] = MS_POLYPRESS | c->output;
+    dBuf[1] = c->keyTable[key];
+    dBuf[2] = val;
+    return 3;
+}
+
+static sint32 remapChanPress(Channel* c, uint8* dBuf, uint8* sBuf, sint32 sLen) {
+    dBuf[0] = MS_CHANPRESS | c->output;
+    dBuf[1] = c->pressTable[sBuf[1]];
+    return 2;
+}
+
+static sint32 remapBend(Channel* c, uint8* dBuf, uint8* sBuf, sint32 sLen) {
+    /* interpolates the 14 bit bend between the two knots either side */
+    sint32        v = sBuf[1] | (sBuf[2] << 7);
+    sint32        f = v & 127;
+    const uint16* k = &c->bendKnots[v >> 7];
+    v = (k[0] * (128 - f) + k[1] * f + 64) >> 7;
+    if (v > BEND_MAX) {
+        v = BEND_MAX;
+    }
+    dBuf[0] = MS_PITCHBEND | c->output;
+    dBuf[1] = v & 127;
+    dBuf[2] = v >> 7;
+    return 3;
+}
+
+static sint32 remapReset(Channel* c, uint8* dBuf, uint8* sBuf, sint32 sLen) {
+    /* system reset, the receiver forgets its controllers */
+    clearShadow();
+    return remapCopy(c, dBuf, sBuf, sLen);
+}
+
+static sint32 remapProg(Channel* c, uint8* dBuf, uint8* sBuf, sint32 sLen) {
+    sint32 i   = 0;
+    sint32 prg = c->currProgIn = sBuf[1];
+    c->keyTable = c->plans[c->progKeys[prg]];
+    if (c->bankMSBTable && (c->noSuppress || sendControl(c->output, 0, c->bankMSBTable[prg]))) {
+        /* default bank MSB for this program# ? */
+        dBuf[i++] = MS_CTRL | c->output;
+        dBuf[i++] = 0;
+        dBuf[i++] = c->bankMSBTable[prg];
+    }
+    if (c->bankLSBTable && (c->noSuppress || sendControl(c->output, 32, c->bankLSBTable[prg]))) {
+        /* default bank LSB for this program# ? */
+        dBuf[i++] = MS_CTRL | c->output;
+        dBuf[i++] = 32;
+        dBuf[i++] = c->bankLSBTable[prg];
+    }
+    if (c->progTable) {
+        prg = c->progTable[prg];
+    }
+    dBuf[i++] = MS_PROG | c->output;
+    dBuf[i++] = prg;
+    return i;
+}
+
+/**************************************************************************/
+
+static void compileBend(Channel* c) {
+    /*
+        Samples the bend curve every 128 steps. Between its points the
+        curve is linear, beyond the end points the end segments carry on.
+        The last knot lies one past BEND_MAX so that the top segment
+        interpolates like the others. Knots are rounded as in pointCurve().
+    */
+    const BendCurve* b = c->bendCurve;
+    sint32 i, j = 0;
+    for (i = 0; i < BEND_KNOTS; i++) {
+        sint32 x = i << 7;
+        sint32 y = x;
+        if (b) {
+            sint32 h, dx, dy, whole, v;
+            while (j < b->numPoints - 2 && x > b->x[j + 1]) {
+                j++;
+            }
+            h  = b->x[j + 1] - b->x[j];
+            dx = x - b->x[j];
+            dy = b->y[j + 1] - b->y[j];
+            /* whole steps and the rest apart, so each product fits 32 bits */
+            whole = dy / h;
+            if (dx && (whole < 0 ? -whole : whole) > (1L << 21) / (dx < 0 ? -dx : dx)) {
+                /* so steep that the points (within +-2^20) can not bring it back in range */
+                y = (whole < 0) != (dx < 0) ? 0 : BEND_MAX + 1;
+            }
+            else {
+                v = dy % h * dx * 2;
+                y = b->y[j] + whole * dx + (v < 0 ? (v - h) / (2 * h) : (v + h) / (2 * h));
+            }
+            y = y < 0 ? 0 : y > BEND_MAX + 1 ? BEND_MAX + 1 : y;
+        }
+        c->bendKnots[i] = y;
+    }
+}
+
+/**************************************************************************/
+
+static bool compileChannel(Setup* s, Channel* c, sint32 in) {
+    sint32 i, j;
+    bool   keysVary   = false;
+    bool   ctrlMapped = false;
+    bool   moved      = c->output != in;
+
+    c->progTable    = poolTable(s, c->programMap);
+    c->bankMSBTable = poolTable(s, c->progBankMSBMap);
+    c->bankLSBTable = poolTable(s, c->progBankLSBMap);
+    c->transTable   = poolTable(s, c->progTransMap);
+
+    /* fused key table per program: key map, else transposed identity */
+    c->plans = s->plans;
+    for (i = 0; i < MIDI_TABLE_SIZE; i++) {
+        sint32 keys = getSparse(&c->noteMaps, i);
+        sint32 k;
+        if (keys) {
+            k = planIndex(s, poolTable(s, keys), 0, PLAN_KEYS);
+        }
+        else {
+            sint32 shift = c->transTable ? (sint8)c->transTable[i] : 0;
+            k = planIndex(s, 0, shift, PLAN_KEYS);
+        }
+        if (k < 0) {
+            return false;
+        }
+        c->progKeys[i] = k;
+        keysVary |= c->progKeys[i] != c->progKeys[0];
+    }
+    /* before any program change the transpose is zero */
+    c->keyTable = getSparse(&c->noteMaps, c->currProgIn) ? s->plans[c->progKeys[c->currProgIn]] : identity;
+
+    if (!(c->velTable = planTable(s, poolTable(s, c->velocityMap), 0, PLAN_VELOCITY))) {
+        return false;
+    }
+    if (!(c->ctrlTable = planTable(s, poolTable(s, c->controlMap), 0, PLAN_CTRL))) {
+        return false;
+    }
+    if (!(c->pressTable = planTable(s, poolTable(s, c->pressureMap), 0, PLAN_DATA))) {
+        return false;
+    }
+    compileBend(c);
+    ctrlMapped = c->controlMap != 0;
+    for (i = 0; i < MIDI_NUM_CONTROLLERS; i++) {
+        /* range map of the remapped controller */
+        sint32 k = planIndex(s, poolTable(s, getSparse(&c->rangeMaps, c->ctrlTable[i])), 0, PLAN_DATA);
+        if (k < 0) {
+            return false;
+        }
+        c->ctrlRange[i] = k;
+        ctrlMapped |= k != 0;
+    }
+
+    c->ctrlOuts = 0;
+    for (i = 0; i < MIDI_TABLE_SIZE; i++) {
+        c->keyRoute[i] = c->velRoute[i] = 0;
+    }
+    for (j = 0; j < c->numSplits; j++) {
+        Split* sp = &c->splits[j];
+        if (!(sp->velTable = planTable(s, poolTable(s, sp->velocityMap ? sp->velocityMap : c->velocityMap), 0, PLAN_VELOCITY))) {
+            return false;
+        }
+        for (i = sp->keyLow; i <= sp->keyHigh; i++) {
+            c->keyRoute[i] |= 1 << j;
+        }
+        for (i = sp->velLow; i <= sp->velHigh; i++) {
+            c->velRoute[i] |= 1 << j;
+        }
+        if (sp->output != c->output) {
+            c->ctrlOuts |= 1 << sp->output;
+        }
+    }
+
+    for (i = 0; i < 8; i++) {
+        c->remap[i] = remapCopy;
+    }
+    /* notes are always tracked so they can be released properly */
+    c->remap[(MS_NOTEOFF >> 4) & 7] = remapNoteOff;
+    c->remap[(MS_NOTEON  >> 4) & 7] = c->numSplits ? remapSplitOn : remapNoteOn;
+    if (moved || ctrlMapped || !c->noSuppress || c->ctrlOuts) {
+        c->remap[(MS_CTRL >> 4) & 7] = remapCtrl;
+    }
+    /* poly pressure follows its note wherever a key map can send it */
+    if (moved || keysVary || c->progKeys[0] || c->numSplits || c->pressureMap) {
+        c->remap[(MS_POLYPRESS >> 4) & 7] = remapPolyPress;
+    }
+    if (moved || c->pressureMap) {
+        c->remap[(MS_CHANPRESS >> 4) & 7] = remapChanPress;
+    }
+    if (moved || c->bendCurve) {
+        c->remap[(MS_PITCHBEND >> 4) & 7] = remapBend;
+    }
+    if (in == (MS_RESET & 0x0F)) {
+        /* system messages dispatch on their low nybble, only reset lands here */
+        c->remap[(MS_RESET >> 4) & 7] = remapReset;
+    }
+    if (moved || keysVary || c->programMap || c->progBankMSBMap || c->progBankLSBMap || c->progTransMap) {
+        c->remap[(MS_PROG >> 4) & 7] = remapProg;
+    }
+    /* what remapBlock() may do inline rather than through the handlers */
+    c->blockFast = 0;
+    if (!c->numSplits) {
+        c->blockFast |= BLOCK_NOTES;
+    }
+    if (c->remap[(MS_CTRL >> 4) & 7] == remapCtrl && !c->ctrlOuts) {
+        c->blockFast |= BLOCK_CTRL;
+    }
+    return true;
+}
+
+/**************************************************************************/
+
+bool compileSetup(Setup* s) {
+    /* builds the flat remap plan for every channel of every port */
+    sint32 i, j;
+    if (identity[MIDI_TABLE_SIZE - 1] != MIDI_TABLE_SIZE - 1) {
+        /* only once: a reload compiles while the active setup reads it */
+        for (i = 0; i < MIDI_TABLE_SIZE; i++) {
+            identity[i] = i;
+        }
+    }
+    s->plans[0] = identity;
+    s->numPlans = 1;
+    for (j = 0; j < s->numPorts; j++) {
+        for (i = 0; i < MIDI_NUM_CHANNELS; i++) {
+            if (!compileChannel(s, &s->ports[j].channels[i], i)) {
+                puts("*** unable to compile remap plan");
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**************************************************************************/
+
+static bool sameTable(const uint8* a, const uint8* b) {
+    sint32 i;
+    for (i = 0; i < MIDI_TABLE_SIZE; i++) {
+        if (a[i] != b[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void carryChannelState(Channel* to, const Channel* from) {
+    /*
+        Takes over the running program state of a channel on a setup swap.
+        The key map follows the program once a program change has selected
+        it, which is told by the contents of the tables, as different plan
+        tables can hold the same keys. Held notes are released by the keys
+        recorded at note on, never through either key map.
+    */
+    sint32 i, j;
+    to->currProgIn = from->currProgIn;
+    if (sameTable(from->keyTable, from->plans[from->progKeys[from->currProgIn]])) {
+        to->keyTable = to->plans[to->progKeys[to->currProgIn]];
+    }
+    /* held notes are still released as they were sent */
+    for (i = 0; i < MIDI_TABLE_SIZE / 32; i++) {
+        to->noteBits[i] = from->noteBits[i];
+    }
+    for (i = 0; i < MIDI_TABLE_SIZE; i++) {
+        to->noteKey[i]    = from->noteKey[i];
+        to->noteOut[i]    = from->noteOut[i];
+        to->noteSplits[i] = from->noteSplits[i];
+    }
+    for (j = 0; j < SPLIT_MAX; j++) {
+        for (i = 0; i < MIDI_TABLE_SIZE; i++) {
+            to->splitKey[j][i] = from->splitKey[j][i];
+            to->splitOut[j][i] = from->splitOut[j][i];
+        }
+    }
+}
+
+/**************************************************************************/
+
+sint32 releaseNotes(Channel* c, uint8* dBuf) {
+    /* writes a note off for every sounding note of a channel */
+    sint32 key, len = 0;
+    for (key = 0; key < MIDI_TABLE_SIZE; key++) {
+        len += releaseKey(c, dBuf + len, key, MS_NOTEOFF, 0);
+    }
+    return len;
+}
+
+/**************************************************************************/
+
+sint32 releaseAllNotes(uint8* dBuf) {
+    /* releases all notes on the active setup, dBuf holds REMAP_MAX_RELEASE */
+    sint32 i, len = 0;
+    if (channels) {
+        for (i = 0; i < MIDI_NUM_CHANNELS; i++) {
+            len += releaseNotes(&channels[i], dBuf + len);
+        }
+    }
+    return len;
+}
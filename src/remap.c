@@ -3,50 +3,77 @@
 */
 
 #include "midimapper.h"
-#include <math.h>
-
-Table*   tableList  = 0;
-Channel* channels   = 0;
-uint32*  directives = 0;
-
-#define FILE_PARSE_BUFFER 256
-
-/* Parser Directives */
-void parseTable(FILE*, char*, sint32);
-void parseCurve(FILE*, char*, sint32);
-void parseChannel(FILE*, char*, sint32);
-void parseProgram(FILE*, char*, sint32);
-void parseProgBankMSB(FILE*, char*, sint32);
-void parseProgBankLSB(FILE*, char*, sint32);
-void parseProgTranspose(FILE*, char*, sint32);
-void parseNotemap(FILE*, char*, sint32);
-void parseVelocity(FILE*, char*, sint32);
-void parseController(FILE*, char*, sint32);
-void parseCtrlRange(FILE*, char*, sint32);
-void parseCtrlInit(FILE*, char*, sint32);
-
-typedef void (*ParseFunc)(FILE*, char*, sint32);
-typedef struct {
+#include <string.h>
+
+Setup*              setup      = 0;   /* active setup */
+TASK_LOCAL Channel* channels   = 0;   /* active setup channels */
+uint32*             directives = 0;
+
+static Setup* building = 0; /* setup being parsed */
+static bool   inPort   = false; /* parsing a port block */
+static bool   usedDefault;      /* channels given outside any port block */
+
+static bool addDefaultPort(Setup* s);
+static bool poolInitBuilds(bool ok);
+
+/* Parser Directives, each returns false after reporting an error */
+bool parseTable(Lexer*, sint32);
+bool parseCurve(Lexer*, sint32);
+bool parseChannel(Lexer*, sint32);
+bool parsePort(Lexer*, sint32);
+bool parseProgram(Lexer*, sint32);
+bool parseProgBankMSB(Lexer*, sint32);
+bool parseProgBankLSB(Lexer*, sint32);
+bool parseProgTranspose(Lexer*, sint32);
+bool parseNotemap(Lexer*, sint32);
+bool parseVelocity(Lexer*, sint32);
+bool parseController(Lexer*, sint32);
+bool parseCtrlRange(Lexer*, sint32);
+bool parseCtrlInit(Lexer*, sint32);
+bool parseSuppress(Lexer*, sint32);
+bool parseSysEx(Lexer*, sint32);
+bool parseSplit(Lexer*, sint32);
+bool parsePressure(Lexer*, sint32);
+bool parseBend(Lexer*, sint32);
+bool parseBendRange(Lexer*, sint32);
+
+typedef bool (*ParseFunc)(Lexer*, sint32);
+typedef struct Directive_t Directive;
+struct Directive_t {
     const char* name;
     uint32      id;
     ParseFunc   parse;
-} Directive;
+    bool        inChannel; /* only valid inside a channel block */
+    Directive*  next;      /* hash chain */
+};
+
+#define DIR_HASH_SIZE 32
+
+static Directive* dirHash[DIR_HASH_SIZE];
 
 static Directive dirs[] = {
     /* file directives */
-    { "end",             0, 0 },
-    { "table:",          0, &parseTable },
-    { "curve:",          0, &parseCurve },
-    { "channel:",        0, &parseChannel },
-    { "program:",        0, &parseProgram },
-    { "progbankmsb:",    0, &parseProgBankMSB },
-    { "progbanklsb:",    0, &parseProgBankLSB },
-    { "progtranspose:",  0, &parseProgTranspose },
-    { "keymap:",         0, &parseNotemap },
-    { "velocity:",       0, &parseVelocity },
-    { "control:",        0, &parseController },
-    { "ctrlrange:",      0, &parseCtrlRange },
-    { "ctrlinit:",       0, &parseCtrlInit },
+    { "end",             0, 0,                   false },
+    { "table:",          0, &parseTable,         false },
+    { "curve:",          0, &parseCurve,         false },
+    { "channel:",        0, &parseChannel,       false },
+    { "port:",           0, &parsePort,          false },
+    { "sysex:",          0, &parseSysEx,         false },
+    /* channel directives */
+    { "program:",        0, &parseProgram,       true },
+    { "progbankmsb:",    0, &parseProgBankMSB,   true },
+    { "progbanklsb:",    0, &parseProgBankLSB,   true },
+    { "progtranspose:",  0, &parseProgTranspose, true },
+    { "keymap:",         0, &parseNotemap,       true },
+    { "velocity:",       0, &parseVelocity,      true },
+    { "control:",        0, &parseController,    true },
+    { "ctrlrange:",      0, &parseCtrlRange,     true },
+    { "ctrlinit:",       0, &parseCtrlInit,      true },
+    { "suppress:",       0, &parseSuppress,      true },
+    { "split:",          0, &parseSplit,         true },
+    { "pressure:",       0, &parsePressure,      true },
+    { "bend:",           0, &parseBend,          true },
+    { "bendrange:",      0, &parseBendRange,     true },
 /*
     { "modulation:",     0, 0 },
     { "breath:",         0, 0 },
@@ -70,7 +97,7 @@ static Directive dirs[] = {
     { "resonance:",      0, 0 },
     { "brightness:",     0, 0 },
 */
-    { 0,                 0, 0}
+    { 0,                 0, 0,                   false }
 };
 
 
@@ -88,38 +115,55 @@ uint32 hashString(const char* string) {
     return hash;
 }
 
+static uint32 hashBucket(uint32 hash, uint32 size) {
+    /* folds an id hash down to a bucket index, size is a power of 2 */
+    return (hash ^ (hash >> 7) ^ (hash >> 15) ^ (hash >> 23)) & (size - 1);
+}
+
 void initDirectives(void) {
     sint32 i = 0;
+    if (dirHash[hashBucket(hashString("end"), DIR_HASH_SIZE)]) {
+        /* already done */
+        return;
+    }
     while (dirs[i].name) {
-        dirs[i].id = hashString(dirs[i].name);
+        uint32 b = hashBucket(dirs[i].id = hashString(dirs[i].name), DIR_HASH_SIZE);
         //printf("%s : 0x%08X\n", dirs[i].name, (unsigned)(dirs[i].id));
+        dirs[i].next = dirHash[b];
+        dirHash[b]   = &dirs[i];
         i++;
     }
 }
 
-bool handleDirective(uint32 id, FILE* file, char* buffer, sint32 in) {
-    sint32 i = 0;
-    while (dirs[i].name) {
-        if (dirs[i].id == id) {
-            //printf("%s\n", dirs[i].name);
-            if (i == 0) {
-                return false;
+#define DIR_FAIL 0
+#define DIR_OK   1
+#define DIR_END  2
+
+static sint32 handleDirective(Lexer* lx, sint32 in) {
+    /* dispatches the directive word at the current token */
+    uint32     id = hashString(lx->word);
+    Directive* d;
+    for (d = dirHash[hashBucket(id, DIR_HASH_SIZE)]; d; d = d->next) {
+        if (d->id == id && strcmp(d->name, lx->word) == 0) {
+            if (d->inChannel != (in != 0)) {
+                lexError(lx, d->inChannel ? "%s is only valid inside a channel" : "%s is not valid inside a channel", d->name);
+                return DIR_FAIL;
+            }
+            if (!d->parse) {
+                return DIR_END;
             }
-            dirs[i].parse(file, buffer, in);
+            return d->parse(lx, in) ? DIR_OK : DIR_FAIL;
         }
-        i++;
     }
-    return true;
+    lexError(lx, "unknown directive '%s'", lx->word);
+    return DIR_FAIL;
 }
 
 /**************************************************************************/
 
-Channel* allocChannels(Table* iniTable) {
-    /* allocates the channel set and initialise with initial table data */
-    Channel* c = (Channel*)AllocMem(
-        MIDI_NUM_CHANNELS * sizeof(Channel),
-        MEMF_PUBLIC | MEMF_CLEAR
-    );
+Channel* allocChannels(Setup* s) {
+    /* allocates a channel set in the setup's arena, each channel to itself */
+    Channel* c = (Channel*)arenaAlloc(&s->arena, MIDI_NUM_CHANNELS * sizeof(Channel));
     if (c) {
         int i;
         for (i=0; i<MIDI_NUM_CHANNELS; i++) {
@@ -131,15 +175,6 @@ Channel* allocChannels(Table* iniTable) {
 
 /**************************************************************************/
 
-void freeChannels(Channel* c) {
-    /* frees the channel set */
-    if (c) {
-        FreeMem(c, MIDI_NUM_CHANNELS*sizeof(Channel));
-    }
-}
-
-/**************************************************************************/
-
 void listChannels(void) {
     int i;
     for (i = 0; i<MIDI_NUM_CHANNELS; i++) {
@@ -149,46 +184,158 @@ void listChannels(void) {
 
 /**************************************************************************/
 
+/*
+    Table contents are interned: every distinct 128 byte table is stored
+    once in the setup's pool and referred to by its 8 bit index, however
+    many names or anonymous uses it has. A table is parsed into tableBuild
+    and pooled by addTable().
+*/
+static uint8 tableBuild[MIDI_TABLE_SIZE];
+
 Table* allocTable(const char* name) {
-    /* allocates a table */
-    Table* table = (Table*)AllocMem(sizeof(Table), MEMF_PUBLIC);
-    if (table) {
-        table->next = 0;
-        if (name) {
-            table->idHash = hashString(name);
-        }
-        else {
-            table->idHash = 0;
+    /* allocates a table in the arena, keeping a copy of its name */
+    Table* table = (Table*)arenaAlloc(&building->arena, sizeof(Table));
+    if (table && name) {
+        if (!(table->name = arenaString(&building->arena, name))) {
+            return 0;
         }
+        table->idHash = hashString(name);
+    }
+    if (table) {
+        memset(tableBuild, 0, MIDI_TABLE_SIZE);
+        table->data = tableBuild;
     }
     return table;
 }
 
 /**************************************************************************/
 
-void freeTable(Table* t) {
-    /* frees a table */
-    if (t) {
-        FreeMem(t, sizeof(Table));
+sint32 internTable(Setup* s, const uint8* data) {
+    /* pool index of a table with these contents, added if new; 0 if the pool is full */
+    uint32 sum = 0;
+    sint32 i;
+    uint8* p;
+    for (i = 0; i < MIDI_TABLE_SIZE; i++) {
+        sum = ((sum << 1) | (sum >> 31)) + data[i];
+    }
+    for (i = s->poolHash[hashBucket(sum, POOL_HASH_SIZE)]; i; i = s->poolNext[i]) {
+        if (s->poolSum[i] == sum && memcmp(s->pool[i], data, MIDI_TABLE_SIZE) == 0) {
+            return i;
+        }
     }
+    if (!s->poolSize) {
+        s->poolSize = 1;
+    }
+    if (s->poolSize == TABLE_POOL || !(p = (uint8*)arenaAlloc(&s->arena, MIDI_TABLE_SIZE))) {
+        return 0;
+    }
+    memcpy(p, data, MIDI_TABLE_SIZE);
+    i = s->poolSize++;
+    s->pool[i]     = p;
+    s->poolSum[i]  = sum;
+    s->poolNext[i] = s->poolHash[hashBucket(sum, POOL_HASH_SIZE)];
+    s->poolHash[hashBucket(sum, POOL_HASH_SIZE)] = i;
+    return i;
+}
+
+const uint8* poolTable(const Setup* s, sint32 index) {
+    /* contents of a pool index, 0 for none */
+    return index ? s->pool[index] : 0;
 }
 
 /**************************************************************************/
 
-void addTable(Table* table) {
-    /* adds a table to the list of tables */
-    if (table) {
-        if (!(tableList)) {
-            tableList = table;
-            return;
+bool setSparse(Setup* s, SparseMap* m, sint32 key, sint32 table) {
+    /* sets the table for a program or controller, keeping keys in order */
+    sint32 i, j;
+    for (i = 0; i < m->count && m->entry[i].key < key; i++)
+        ;
+    if (i < m->count && m->entry[i].key == key) {
+        m->entry[i].table = table;
+        return true;
+    }
+    if (m->count == m->size) {
+        /* grows by doubling, up to one entry per key; the old entries stay in the arena */
+        sint32    size  = m->size ? m->size * 2 : 4;
+        MapEntry* entry = (MapEntry*)arenaAlloc(&s->arena, size * sizeof(MapEntry));
+        if (!entry) {
+            return false;
+        }
+        for (j = 0; j < m->count; j++) {
+            entry[j] = m->entry[j];
+        }
+        m->entry = entry;
+        m->size  = size > MIDI_TABLE_SIZE ? MIDI_TABLE_SIZE : size;
+    }
+    for (j = m->count++; j > i; j--) {
+        m->entry[j] = m->entry[j - 1];
+    }
+    m->entry[i].key   = key;
+    m->entry[i].table = table;
+    return true;
+}
+
+sint32 getSparse(const SparseMap* m, sint32 key) {
+    /* the table for a program or controller, 0 if none */
+    sint32 lo = 0, hi = m->count;
+    while (lo < hi) {
+        sint32 mid = (lo + hi) >> 1;
+        if (m->entry[mid].key < key) {
+            lo = mid + 1;
         }
         else {
-            Table* t;
-            for (t = tableList; t->next; t = t->next) {
+            hi = mid;
+        }
+    }
+    return lo < m->count && m->entry[lo].key == key ? m->entry[lo].table : 0;
+}
+
+/**************************************************************************/
+
+bool addTable(Table* table) {
+    /*
+        Pools the contents of a table and, if it is named, adds it to the
+        list and the hash. A second definition of a name is reported and
+        dropped, the first one stays in use. False only if the table could
+        not be allocated or the pool is full.
+    */
+    sint32 index;
+    if (!table) {
+        return false;
+    }
+    if (table->name) {
+        Table** bucket = &building->tableHash[hashBucket(table->idHash, TABLE_HASH_SIZE)];
+        Table*  t;
+        for (t = *bucket; t; t = t->hashNext) {
+            if (t->idHash != table->idHash) {
+                continue;
+            }
+            if (strcmp(t->name, table->name) == 0) {
+                printf("*** table %s already defined, ignoring redefinition\n", table->name);
+                return true;
             }
-            t->next = table;
+            printf("note: tables %s and %s share id hash 0x%08X\n", t->name, table->name, (unsigned)table->idHash);
         }
     }
+    if (!(index = internTable(building, table->data))) {
+        printf("*** more than %d different tables\n", TABLE_POOL - 1);
+        return false;
+    }
+    table->index = index;
+    table->data  = building->pool[index];
+    if (table->name) {
+        Table** bucket = &building->tableHash[hashBucket(table->idHash, TABLE_HASH_SIZE)];
+        table->hashNext = *bucket;
+        *bucket         = table;
+    }
+    if (building->tableTail) {
+        building->tableTail->next = table;
+    }
+    else {
+        building->tableList = table;
+    }
+    building->tableTail = table;
+    return true;
 }
 
 /**************************************************************************/
@@ -198,11 +345,11 @@ Table* findTable(const char* name) {
     uint32 hash;
     Table* t;
     if (!name) {
-        return tableList; /* the default table */
+        return building->tableList; /* the default table */
     }
     hash = hashString(name);
-    for (t = tableList; t; t = t->next) {
-        if (hash == t->idHash) {
+    for (t = building->tableHash[hashBucket(hash, TABLE_HASH_SIZE)]; t; t = t->hashNext) {
+        if (hash == t->idHash && strcmp(name, t->name) == 0) {
             return t;
         }
     }
@@ -229,509 +376,1108 @@ void dumpTable(const Table* t) {
 void listTables(void) {
     Table* t;
     sint32 i = 0;
-    for (t = tableList; t; t = t->next, i++) {
-        printf("Table %ld : idHash 0x%08X\n", i, (unsigned)t->idHash);
+    for (t = setup->tableList; t; t = t->next, i++) {
+        printf("Table %ld : idHash 0x%08X\n", (long)i, (unsigned)t->idHash);
     }
 }
 
 /**************************************************************************/
 
-bool readWord(FILE* file, char* buffer) {
-    /* reads a single non-comment word from a file */
-    if (!file) {
+bool parseSetup(const char* fName) {
+    /* parses a configuration file into the setup being built */
+    Lexer  lx;
+    sint32 result = DIR_OK;
+    puts("\nparseSetup()");
+    if (!openLexer(&lx, fName)) {
         return false;
     }
-    else {
-        bool gotWord = false;
-        while (!gotWord && !feof(file)) {
-            if (fscanf(file, "%s", buffer) == 0) {
-                return false;
-            }
-            if (buffer[0] == '/' && buffer[1] == '/') {
-                sint32 ch;
-                do {
-                    ch = fgetc(file);
-                } while (ch!='\n');
-            }
-            else {
-                gotWord = true;
-            }
+    while (result == DIR_OK) {
+        if (!nextToken(&lx)) {
+            result = DIR_FAIL;
+        }
+        else if (lx.type == TOK_END) {
+            result = DIR_END;
+        }
+        else if (lx.type != TOK_WORD) {
+            lexError(&lx, "expected a directive, found '%s'", lx.word);
+            result = DIR_FAIL;
         }
-        return gotWord;
+        else {
+            result = handleDirective(&lx, 0);
+        }
+    }
+    closeLexer(&lx);
+    if (!poolInitBuilds(result != DIR_FAIL)) {
+        result = DIR_FAIL;
     }
-    return false;
+    if (result == DIR_FAIL) {
+        printf("*** configuration %s not loaded\n", fName);
+        return false;
+    }
+    puts("configuration complete\n");
+    return true;
 }
 
 /**************************************************************************/
 
-bool parseSetup(const char* fName) {
-    FILE* file;
-    char* buffer;
-    puts("\nparseSetup()");
-    if (!(buffer = (char*)AllocMem(FILE_PARSE_BUFFER, MEMF_PUBLIC|MEMF_CLEAR))) {
-        puts("*** unable to allocate parse buffer");
+static bool tableValue(Lexer* lx, sint32 value) {
+    /* table entries are bytes, signed for offsets such as transposition */
+    if (lx->isReal || value < -128 || value > 255) {
+        return lexError(lx, "table value must be a whole number -128..255");
+    }
+    return true;
+}
+
+bool parseTable(Lexer* lx, sint32 in) {
+    Table* table;
+    sint32 i = 0;
+    if (!expectToken(lx, TOK_WORD, "table name")) {
         return false;
     }
-    if (!(file = fopen(fName, "r"))) {
-        FreeMem(buffer, FILE_PARSE_BUFFER);
-        printf("*** unable to open %s\n", fName);
+    if (!(table = allocTable(lx->word))) {
+        return lexError(lx, "unable to allocate table %s", lx->word);
+    }
+    printf("Define table %s\n", table->name);
+    if (!nextToken(lx)) {
         return false;
     }
-
-    while (!(feof(file))) {
-        /* pull out a word */
-        if (readWord(file, buffer)) {
-            uint32 d = hashString(buffer);
-            if (handleDirective(d, file, buffer, 0)==false) {
+    if (lx->type == TOK_NUMBER) {
+        /* partial form: default value then index:value pairs */
+        if (!tableValue(lx, lx->value)) {
+            return false;
+        }
+        for (i = 0; i < MIDI_TABLE_SIZE; i++) {
+            table->data[i] = lx->value;
+        }
+        if (!expectToken(lx, TOK_LBRACE, "'{'")) {
+            return false;
+        }
+        i = 0;
+        for (;;) {
+            if (!nextToken(lx)) {
+                return false;
+            }
+            if (lx->type == TOK_RBRACE) {
                 break;
             }
+            if (lx->type != TOK_PAIR) {
+                lexError(lx, "expected index:value or '}', found '%s'", lx->type == TOK_END ? "end of file" : lx->word);
+                return false;
+            }
+            if (lx->value < 0 || lx->value >= MIDI_TABLE_SIZE) {
+                lexError(lx, "table index must be 0..127");
+                return false;
+            }
+            if (!tableValue(lx, lx->value2)) {
+                return false;
+            }
+            table->data[lx->value] = lx->value2;
+            i++;
         }
     }
-    fclose(file);
-    FreeMem(buffer, FILE_PARSE_BUFFER);
-    puts("configuration complete\n");
-    return true;
-}
-
-/**************************************************************************/
-
-void parseTable(FILE* file, char* buffer, sint32 in) {
-    Table* table=0;
-    if (readWord(file, buffer)) {
-        sint32 fill;
-        if (table = allocTable(buffer)) {
-            sint32 val = 0;
-            sint32 i   = 0;
-            printf("Define table %s\n", buffer);
-            if (fscanf(file, "%ld {", &fill)==1) {
-                for (i=0; i<MIDI_TABLE_SIZE; i++) {
-                    table->data[i] = val;
-                }
-                while (buffer[0]!='}' && !feof(file)) {
-                    readWord(file, buffer);
-                    if (sscanf(buffer, "%ld:%ld", &i, &val) != 2) {
-                        break;
-                    }
-                    table->data[i] = val;
-                }
+    else if (lx->type == TOK_LBRACE) {
+        /* list form: up to 128 values in order */
+        for (;;) {
+            if (!nextToken(lx)) {
+                return false;
             }
-            else {
-                while (i < MIDI_TABLE_SIZE && buffer[0] != '}' && !feof(file)) {
-                    readWord(file, buffer);
-                    if (sscanf(buffer, "%ld", &val) == 0) {
-                        break;
-                    }
-                    table->data[i++] = val;
-                }
+            if (lx->type == TOK_RBRACE) {
+                break;
             }
-            printf(
-                "\tread  %ld\n"
-                "\tid    0x%08X\n",
-                i, (unsigned)table->idHash
-            );
+            if (lx->type != TOK_NUMBER) {
+                lexError(lx, "expected a value or '}', found '%s'", lx->type == TOK_END ? "end of file" : lx->word);
+                return false;
+            }
+            if (i == MIDI_TABLE_SIZE) {
+                lexError(lx, "table %s has more than %d values", table->name, MIDI_TABLE_SIZE);
+                return false;
+            }
+            if (!tableValue(lx, lx->value)) {
+                return false;
+            }
+            table->data[i++] = lx->value;
         }
-        addTable(table);
     }
+    else {
+        lexError(lx, "expected '{' or a default value, found '%s'", lx->type == TOK_END ? "end of file" : lx->word);
+        return false;
+    }
+    printf(
+        "\tread  %ld\n"
+        "\tid    0x%08X\n",
+        (long)i, (unsigned)table->idHash
+    );
+    return addTable(table);
 }
 
 /**************************************************************************/
 
-void parseCurve(FILE* file, char* buffer, sint32 in) {
-    Table* table=0;
-    if (readWord(file, buffer)) {
-        sint32  min   = 0;
-        sint32  max   = 127;
-        sint32  zeroX = 0;
-        sint32  zeroY = 0;
-        float64 grad  = 1.0;
-        float64 power = 1.0;
+static void fixedText(char* buf, sint32 v) {
+    /* 16.16 to text with 4 decimal places */
+    uint32 u = v < 0 ? -v : v;
+    uint32 f = ((u & 0xFFFF) * 10000 + 0x8000) >> 16;
+    sprintf(buf, "%s%lu.%04lu", v < 0 ? "-" : "", (unsigned long)(u >> 16) + f / 10000, (unsigned long)f % 10000);
+}
 
-        if (table = allocTable(buffer)) {
-            sint32 i=0;
+static bool parseCurvePoints(Lexer* lx, Table* table, const char* kind) {
+    /* points, spline, exp or log: x:y pairs up to '}' */
+    uint8  x[CURVE_POINTS], y[CURVE_POINTS];
+    sint32 n = 0;
+    bool   knee = kind[0] == 'e' || kind[0] == 'l';
+    for (;;) {
+        if (!nextToken(lx)) {
+            return false;
+        }
+        if (lx->type == TOK_RBRACE) {
+            break;
+        }
+        if (lx->type != TOK_PAIR) {
+            return lexError(lx, "expected x:y or '}', found '%s'", lx->type == TOK_END ? "end of file" : lx->word);
+        }
+        if (lx->value < 0 || lx->value > 127 || lx->value2 < 0 || lx->value2 > 127) {
+            return lexError(lx, "curve points must be 0..127");
+        }
+        if (n == CURVE_POINTS) {
+            return lexError(lx, "curve has more than %d points", CURVE_POINTS);
+        }
+        if (n && lx->value <= x[n - 1]) {
+            return lexError(lx, "curve points must be in rising order of x");
+        }
+        x[n]   = lx->value;
+        y[n++] = lx->value2;
+    }
+    if (knee) {
+        if (n != 1 || x[0] == 0 || x[0] == 127 || y[0] == 0 || y[0] == 127) {
+            return lexError(lx, "%s curve needs one knee point between 1:1 and 126:126", kind);
+        }
+        if (kind[0] == 'e' ? y[0] > x[0] : y[0] < x[0]) {
+            return lexError(lx, "%s curve knee must lie %s the diagonal", kind, kind[0] == 'e' ? "below" : "above");
+        }
+        if (!kneeCurve(table->data, x[0], y[0], kind[0] == 'l')) {
+            return lexError(lx, "%s curve knee %ld:%ld is too sharp", kind, (long)x[0], (long)y[0]);
+        }
+        printf("\tkind  %s\n\tknee  %ld:%ld\n", kind, (long)x[0], (long)y[0]);
+        return true;
+    }
+    if (n < 2) {
+        return lexError(lx, "%s curve needs at least 2 points", kind);
+    }
+    pointCurve(table->data, x, y, n, kind[0] == 's');
+    printf("\tkind  %s\n\tcount %ld\n", kind, (long)n);
+    return true;
+}
 
-            printf("Define curve %s\n", buffer);
-            fscanf(file, "%s{", buffer);
+bool parseCurve(Lexer* lx, sint32 in) {
+    /*
+        curve: <name> { [min [max [zeroX [zeroY [grad [power]]]]]] }
+        curve: <name> points|spline { x:y ... }
+        curve: <name> exp|log { x:y }
+    */
+    static const char* kinds[] = { "points", "spline", "exp", "log" };
+    Table* table;
+    sint32 param[6] = { 0, 127, 0, 0, FIX_ONE, FIX_ONE };
+    char   grad[16], power[16];
+    sint32 i;
 
-            if (readWord(file, buffer)) {
-                sscanf(buffer, "%ld", &min);
-            }
-            if (readWord(file, buffer)) {
-                sscanf(buffer, "%ld", &max);
-            }
-            if (readWord(file, buffer)) {
-                sscanf(buffer, "%ld", &zeroX);
-            }
-            if (readWord(file, buffer)) {
-                sscanf(buffer, "%ld", &zeroY);
-            }
-            if (readWord(file, buffer)) {
-                sscanf(buffer, "%lf", &grad);
-            }
-            if (readWord(file, buffer)) {
-                sscanf(buffer, "%lf", &power);
-            }
-            fscanf(file, "%s}", buffer);
-            printf(
-                "\tmin   %ld\n"
-                "\tmax   %ld\n"
-                "\tzeroX %ld\n"
-                "\tzeroY %ld\n"
-                "\tgrad  %f\n"
-                "\tpower %f\n"
-                "\tid    0x%08X\n",
-                min, max, zeroX, zeroY, grad, power,
-                (unsigned)table->idHash
-            );
-            {
-                float64 yScale = (max-min);
-                grad /= MIDI_TABLE_SIZE;
-                for ( i =0; i < MIDI_TABLE_SIZE; i++) {
-                    sint32 x = i - zeroX;
-                    sint32 y;
-                    if (x < 0) {
-                        y = (sint32)(( -yScale * (pow(grad * (-x), power)))) + zeroY;
-                    }
-                    else {
-                        y = (sint32)((yScale * (pow(grad * x, power)))) + zeroY;
-                    }
-                    table->data[i] = y > max ? max : y < min ? min : y;
-                }
-            }
-            addTable(table);
+    if (!expectToken(lx, TOK_WORD, "curve name")) {
+        return false;
+    }
+    if (!(table = allocTable(lx->word))) {
+        return lexError(lx, "unable to allocate curve %s", lx->word);
+    }
+    printf("Define curve %s\n", table->name);
+    if (!nextToken(lx)) {
+        return false;
+    }
+    if (lx->type == TOK_WORD) {
+        for (i = 0; i < 4 && strcmp(lx->word, kinds[i]) != 0; i++)
+            ;
+        if (i == 4) {
+            return lexError(lx, "unknown curve kind '%s'", lx->word);
+        }
+        if (!expectToken(lx, TOK_LBRACE, "'{'") || !parseCurvePoints(lx, table, kinds[i])) {
+            return false;
+        }
+        printf("\tid    0x%08X\n", (unsigned)table->idHash);
+        return addTable(table);
+    }
+    if (lx->type != TOK_LBRACE) {
+        return lexError(lx, "expected '{' or a curve kind, found '%s'", lx->type == TOK_END ? "end of file" : lx->word);
+    }
+    for (i = 0; ; i++) {
+        if (!nextToken(lx)) {
+            return false;
+        }
+        if (lx->type == TOK_RBRACE) {
+            break;
         }
+        if (lx->type != TOK_NUMBER || i == 6) {
+            return lexError(lx, "expected up to 6 curve parameters and '}', found '%s'", lx->type == TOK_END ? "end of file" : lx->word);
+        }
+        /* the first four parameters are whole numbers, the rest 16.16 */
+        param[i] = i < 4 ? lx->value : lx->fixed;
+    }
+    if (param[4] < 0 && (param[5] & 0xFFFF)) {
+        return lexError(lx, "a negative gradient needs a whole number power");
     }
+    fixedText(grad, param[4]);
+    fixedText(power, param[5]);
+    printf(
+        "\tmin   %ld\n"
+        "\tmax   %ld\n"
+        "\tzeroX %ld\n"
+        "\tzeroY %ld\n"
+        "\tgrad  %s\n"
+        "\tpower %s\n"
+        "\tid    0x%08X\n",
+        (long)param[0], (long)param[1], (long)param[2], (long)param[3], grad, power,
+        (unsigned)table->idHash
+    );
+    powerCurve(table->data, param[0], param[1], param[2], param[3], param[4], param[5]);
+    return addTable(table);
 }
 
 /**************************************************************************/
 
-void parseChannel(FILE* file, char* buffer, sint32 in) {
-    sint32 out;
-    if (fscanf(file, "%ld %ld {", &in, &out)==2) {
-        uint32 d;
-        channels[in - 1].output = out - 1;
-        printf("Define channel %ld -> %ld\n", in, out);
-        while (buffer[0] != '}' && !feof(file)) {
-            if (readWord(file, buffer)) {
-                d = hashString(buffer);
-                handleDirective(d, file, buffer, in);
-            }
+bool parseChannel(Lexer* lx, sint32 in) {
+    /* channel: <in> <out> { directives } */
+    sint32 chIn, chOut;
+    if (!expectInteger(lx, 1, MIDI_NUM_CHANNELS, "input channel")) {
+        return false;
+    }
+    chIn = lx->value;
+    if (!expectInteger(lx, 1, MIDI_NUM_CHANNELS, "output channel")) {
+        return false;
+    }
+    chOut = lx->value;
+    if (!expectToken(lx, TOK_LBRACE, "'{'")) {
+        return false;
+    }
+    if (!inPort && !usedDefault && !addDefaultPort(building)) {
+        return lexError(lx, "unable to allocate channels");
+    }
+    building->channels[chIn - 1].output = chOut - 1;
+    printf("Define channel %ld -> %ld\n", (long)chIn, (long)chOut);
+    for (;;) {
+        if (!nextToken(lx)) {
+            return false;
+        }
+        if (lx->type == TOK_RBRACE) {
+            return true;
+        }
+        if (lx->type == TOK_END) {
+            return lexError(lx, "missing '}' for channel %ld", (long)chIn);
+        }
+        if (lx->type != TOK_WORD) {
+            return lexError(lx, "expected a channel directive, found '%s'", lx->word);
+        }
+        if (handleDirective(lx, chIn) != DIR_OK) {
+            return false;
         }
     }
 }
 
 /**************************************************************************/
 
-void parseProgram(FILE* file, char* buffer, sint32 in) {
-    Table* table=0;
-    if (readWord(file, buffer)) {
-        if (table = findTable(buffer)) {
-            channels[in - 1].programMap = table->data;
-            return;
-        }
+Port* allocPort(Setup* s, const char* inName, const char* outName) {
+    /* adds an input/output pair with its own channel set */
+    Port* p;
+    if (s->numPorts == PORT_MAX || !(s->ports[s->numPorts].channels = allocChannels(s))) {
+        return 0;
     }
-    printf("channel %ld - failed to set program table\n", in);
+    p = &s->ports[s->numPorts++];
+    strncpy(p->inName, inName, PORT_NAME - 1);
+    strncpy(p->outName, outName, PORT_NAME - 1);
+    s->channels = s->ports[0].channels;
+    return p;
 }
 
 /**************************************************************************/
 
-void parseProgBankMSB(FILE* file, char* buffer, sint32 in) {
-    Table* table=0;
-    if (readWord(file, buffer)) {
-        if (table = findTable(buffer)) {
-            channels[in - 1].progBankMSBMap = table->data;
-            return;
-        }
+static bool addDefaultPort(Setup* s) {
+    /* the MidiIn to MidiOut port, first in the list, once channels are given outside a port block */
+    Port   p;
+    sint32 i;
+    if (!allocPort(s, "MidiIn", "MidiOut")) {
+        return false;
+    }
+    p = s->ports[s->numPorts - 1];
+    for (i = s->numPorts - 1; i > 0; i--) {
+        s->ports[i] = s->ports[i - 1];
     }
-    printf("channel %ld - failed to set progbankmsb table\n", in);
+    s->ports[0] = p;
+    s->channels = p.channels;
+    usedDefault = true;
+    return true;
 }
 
 /**************************************************************************/
 
-void parseProgBankLSB(FILE* file, char* buffer, sint32 in) {
-    Table* table=0;
-    if (readWord(file, buffer)) {
-        if (table = findTable(buffer)) {
-            channels[in - 1].progBankLSBMap = table->data;
-            return;
+bool parsePort(Lexer* lx, sint32 in) {
+    /* port: <input cluster> <output cluster> { channel: ... } */
+    Port*  p;
+    char   inName[PORT_NAME];
+    sint32 result = DIR_OK;
+    if (inPort) {
+        return lexError(lx, "ports can not be nested");
+    }
+    if (!expectToken(lx, TOK_WORD, "input cluster name")) {
+        return false;
+    }
+    if (strlen(lx->word) >= PORT_NAME) {
+        return lexError(lx, "cluster names are at most %d characters", PORT_NAME - 1);
+    }
+    strcpy(inName, lx->word);
+    if (!expectToken(lx, TOK_WORD, "output cluster name")) {
+        return false;
+    }
+    if (strlen(lx->word) >= PORT_NAME) {
+        return lexError(lx, "cluster names are at most %d characters", PORT_NAME - 1);
+    }
+    /* one slot is kept for the default port */
+    if (building->numPorts - usedDefault == PORT_MAX - 1 || !(p = allocPort(building, inName, lx->word))) {
+        return lexError(lx, "more than %d ports", PORT_MAX - 1);
+    }
+    if (!expectToken(lx, TOK_LBRACE, "'{'")) {
+        return false;
+    }
+    printf("Define port %s -> %s\n", p->inName, p->outName);
+    /* channel: directives in the block build the port's channels */
+    inPort             = true;
+    building->channels = p->channels;
+    while (result == DIR_OK) {
+        if (!nextToken(lx)) {
+            result = DIR_FAIL;
+        }
+        else if (lx->type == TOK_RBRACE) {
+            break;
+        }
+        else if (lx->type != TOK_WORD) {
+            lexError(lx, "expected a directive or '}', found '%s'", lx->type == TOK_END ? "end of file" : lx->word);
+            result = DIR_FAIL;
         }
+        else if ((result = handleDirective(lx, 0)) == DIR_END) {
+            lexError(lx, "missing '}' for port %s", p->inName);
+        }
+    }
+    inPort             = false;
+    building->channels = building->ports[0].channels;
+    return result == DIR_OK;
+}
+
+/**************************************************************************/
+
+static sint32 lookupTable(Lexer* lx) {
+    /* resolves the table named by the current token to its pool index */
+    Table* table;
+    if (lx->type != TOK_WORD) {
+        lexError(lx, "expected a table name, found '%s'", lx->type == TOK_END ? "end of file" : lx->word);
+        return 0;
     }
-    printf("channel %ld - failed to set progbanklsb table\n", in);
+    if (!(table = findTable(lx->word))) {
+        lexError(lx, "unknown table %s", lx->word);
+        return 0;
+    }
+    return table->index;
+}
+
+static sint32 tableRef(Lexer* lx) {
+    /* reads and resolves a table name */
+    return nextToken(lx) ? lookupTable(lx) : 0;
+}
+
+/**************************************************************************/
+
+bool parseProgram(Lexer* lx, sint32 in) {
+    return (building->channels[in - 1].programMap = tableRef(lx)) != 0;
+}
+
+/**************************************************************************/
+
+bool parseProgBankMSB(Lexer* lx, sint32 in) {
+    return (building->channels[in - 1].progBankMSBMap = tableRef(lx)) != 0;
+}
+
+/**************************************************************************/
+
+bool parseProgBankLSB(Lexer* lx, sint32 in) {
+    return (building->channels[in - 1].progBankLSBMap = tableRef(lx)) != 0;
 }
 
 /**************************************************************************/
 
-void parseProgTranspose(FILE* file, char* buffer, sint32 in) {
-    Table* table=0;
-    if (readWord(file, buffer)) {
-        if (table = findTable(buffer)) {
-            channels[in - 1].progTransMap = table->data;
-            return;
+bool parseProgTranspose(Lexer* lx, sint32 in) {
+    return (building->channels[in - 1].progTransMap = tableRef(lx)) != 0;
+}
+
+/**************************************************************************/
+
+bool parseNotemap(Lexer* lx, sint32 in) {
+    /* keymap: <first program> [<last program>] <table> */
+    sint32 index;
+    sint32 progNum1, progNum2, i;
+    if (!expectInteger(lx, 0, 127, "program number")) {
+        return false;
+    }
+    progNum1 = progNum2 = lx->value;
+    if (!nextToken(lx)) {
+        return false;
+    }
+    if (lx->type == TOK_NUMBER) {
+        if (lx->isReal || lx->value < progNum1 || lx->value > 127) {
+            return lexError(lx, "last program must be a whole number %ld..127", (long)progNum1);
+        }
+        progNum2 = lx->value;
+        if (!nextToken(lx)) {
+            return false;
+        }
+    }
+    if (!(index = lookupTable(lx))) {
+        return false;
+    }
+    for (i = progNum1; i <= progNum2; i++) {
+        if (!setSparse(building, &building->channels[in - 1].noteMaps, i, index)) {
+            return lexError(lx, "unable to allocate key map entry");
         }
     }
-    printf("channel %ld - failed to set progtranspose table\n", in);
+    return true;
+}
+
+/**************************************************************************/
+
+bool parseVelocity(Lexer* lx, sint32 in) {
+    return (building->channels[in - 1].velocityMap = tableRef(lx)) != 0;
+}
+
+/**************************************************************************/
+
+bool parseController(Lexer* lx, sint32 in) {
+    return (building->channels[in - 1].controlMap = tableRef(lx)) != 0;
+}
+
+/**************************************************************************/
+
+bool parseCtrlRange(Lexer* lx, sint32 in) {
+    /* ctrlrange: <controller> <table> */
+    sint32 ctrlNum, index;
+    if (!expectInteger(lx, 0, MIDI_NUM_CONTROLLERS - 1, "controller number")) {
+        return false;
+    }
+    ctrlNum = lx->value;
+    if (!(index = tableRef(lx))) {
+        return false;
+    }
+    if (!setSparse(building, &building->channels[in - 1].rangeMaps, ctrlNum, index)) {
+        return lexError(lx, "unable to allocate range map entry");
+    }
+    return true;
 }
 
 /**************************************************************************/
 
-void parseNotemap(FILE* file, char* buffer, sint32 in) {
-    Table* table    = 0;
-    sint32 progNum1 = 0;
-    sint32 progNum2 = 127;
-    bool   range = false;
-    readWord(file, buffer);
-    if (sscanf(buffer, "%ld", &progNum1) == 1) {
-        readWord(file, buffer);
-        if (sscanf(buffer, "%ld", &progNum2) == 1) {
-            range = true;
-            readWord(file, buffer);
+/*
+    Single controller values are gathered per channel while parsing and
+    only pooled at the end of the config, so that each channel's values
+    end up in one table. The gathered values are in the arena like the
+    rest of the setup; a dropped one is just unlinked.
+*/
+typedef struct InitBuild_t {
+    struct InitBuild_t* next;
+    Channel*            c;
+    uint8               data[MIDI_NUM_CONTROLLERS];
+} InitBuild;
+
+static InitBuild* initBuilds;
+
+static InitBuild* findInitBuild(Channel* c, bool drop) {
+    /* the values gathered for a channel, removed from the list if drop */
+    InitBuild** p;
+    InitBuild*  b;
+    for (p = &initBuilds; (b = *p); p = &b->next) {
+        if (b->c == c) {
+            if (drop) {
+                *p = b->next;
+                return 0;
+            }
+            return b;
         }
-        if ( (table = findTable(buffer)) ) {
-            if (range) {
-                sint32 i;
-                for (i = progNum1; i <= progNum2; i++) {
-                    channels[in - 1].noteMap[i] = table->data;
-                }
-                return;
+    }
+    return 0;
+}
+
+static bool poolInitBuilds(bool ok) {
+    /* pools the gathered controller values, or just forgets them */
+    InitBuild* b;
+    sint32     index;
+    while ((b = initBuilds)) {
+        initBuilds = b->next;
+        if (ok) {
+            if ((index = internTable(building, b->data))) {
+                b->c->controlInit = index;
             }
             else {
-                channels[in - 1].noteMap[progNum1] = table->data;
-                return;
+                printf("*** more than %d different tables\n", TABLE_POOL - 1);
+                ok = false;
             }
         }
+    }
+    return ok;
+}
+
+bool parseCtrlInit(Lexer* lx, sint32 in) {
+    /* ctrlinit: <controller> <value> or ctrlinit: <table> */
+    Channel*   c = &building->channels[in - 1];
+    InitBuild* b;
+    sint32     ctrlNum;
+    if (!nextToken(lx)) {
+        return false;
+    }
+    if (lx->type != TOK_NUMBER) {
+        /* an existing table was specified rather than a single controller num */
+        findInitBuild(c, true);
+        return (c->controlInit = lookupTable(lx)) != 0;
+    }
+    if (lx->isReal || lx->value < 0 || lx->value >= MIDI_NUM_CONTROLLERS) {
+        return lexError(lx, "controller number must be a whole number 0..%d", MIDI_NUM_CONTROLLERS - 1);
+    }
+    ctrlNum = lx->value;
+    if (!expectInteger(lx, 0, 127, "controller value")) {
+        return false;
+    }
+    /* the first value starts from the channel's table, or from none set */
+    if (!(b = findInitBuild(c, false))) {
+        if (!(b = (InitBuild*)arenaAlloc(&building->arena, sizeof(InitBuild)))) {
+            return lexError(lx, "unable to allocate initial controller table");
+        }
+        if (c->controlInit) {
+            memcpy(b->data, poolTable(building, c->controlInit), MIDI_NUM_CONTROLLERS);
+        }
         else {
-            printf("channel %ld - failed to set keymap for %ld...%ld\n", in, progNum1, progNum2);
+            memset(b->data, 0xFF, MIDI_NUM_CONTROLLERS);
         }
+        b->c       = c;
+        b->next    = initBuilds;
+        initBuilds = b;
+    }
+    b->data[ctrlNum] = lx->value;
+    return true;
+}
+
+/**************************************************************************/
+
+bool parseSuppress(Lexer* lx, sint32 in) {
+    /* suppress: on|off, dropping controller values the receiver already has */
+    if (!expectToken(lx, TOK_WORD, "on or off")) {
+        return false;
+    }
+    if (strcmp(lx->word, "on") == 0) {
+        building->channels[in - 1].noSuppress = 0;
+    }
+    else if (strcmp(lx->word, "off") == 0) {
+        building->channels[in - 1].noSuppress = 1;
     }
     else {
-        printf("channel %ld - failed to set keymap for %ld\n", in, progNum1);
+        return lexError(lx, "expected on or off, found '%s'", lx->word);
     }
+    return true;
 }
 
 /**************************************************************************/
 
-void parseVelocity(FILE* file, char* buffer, sint32 in) {
-    Table* table = 0;
-    if (readWord(file, buffer)) {
-        if (table = findTable(buffer)) {
-            channels[in - 1].velocityMap = table->data;
-            return;
+bool parseSysEx(Lexer* lx, sint32 in) {
+    /*
+        sysex: <manufacturer> <model|any> {
+            device:     <device ID>
+            devicemask: <bits of the device ID to replace>
+            checksum:   roland
+        }
+    */
+    SysExRule* r;
+    sint32     man, model = SYSEX_ANY_MODEL;
+    if (!expectInteger(lx, 1, 0x7F, "manufacturer ID")) {
+        return false;
+    }
+    man = lx->value;
+    if (!nextToken(lx)) {
+        return false;
+    }
+    if (lx->type != TOK_WORD || strcmp(lx->word, "any") != 0) {
+        if (lx->type != TOK_NUMBER || lx->isReal || lx->value < 0 || lx->value > 0x7F) {
+            return lexError(lx, "model ID must be 0..127 or any");
+        }
+        model = lx->value;
+    }
+    if (!expectToken(lx, TOK_LBRACE, "'{'")) {
+        return false;
+    }
+    if (!(r = allocSysExRule(building, man, model))) {
+        return lexError(lx, "unable to allocate SysEx rule");
+    }
+    printf("Define SysEx rule 0x%02X 0x%02X\n", (unsigned)man, (unsigned)(model & 0xFF));
+    for (;;) {
+        if (!nextToken(lx)) {
+            return false;
+        }
+        if (lx->type == TOK_RBRACE) {
+            return true;
+        }
+        if (lx->type == TOK_WORD && strcmp(lx->word, "device:") == 0) {
+            if (!expectInteger(lx, 0, 0x7F, "device ID")) {
+                return false;
+            }
+            r->device  = lx->value;
+            r->flags  |= SYSEX_DEVICE;
+        }
+        else if (lx->type == TOK_WORD && strcmp(lx->word, "devicemask:") == 0) {
+            if (!expectInteger(lx, 0, 0x7F, "device ID mask")) {
+                return false;
+            }
+            r->deviceMask = lx->value;
+        }
+        else if (lx->type == TOK_WORD && strcmp(lx->word, "checksum:") == 0) {
+            if (!expectToken(lx, TOK_WORD, "checksum kind") || strcmp(lx->word, "roland") != 0) {
+                return lx->type == TOK_WORD ? lexError(lx, "unknown checksum kind %s", lx->word) : false;
+            }
+            r->flags |= SYSEX_CHECKSUM;
+        }
+        else if (lx->type == TOK_END) {
+            return lexError(lx, "missing '}' for SysEx rule");
+        }
+        else {
+            return lexError(lx, "expected device:, devicemask:, checksum: or '}', found '%s'", lx->word);
         }
     }
-    printf("channel %ld - failed to set velocity table\n", in);
 }
 
 /**************************************************************************/
 
-void parseController(FILE* file, char* buffer, sint32 in) {
-    Table* table = 0;
-    if (readWord(file, buffer)) {
-        if (table = findTable(buffer)) {
-            channels[in - 1].controlMap = table->data;
-            return;
-        }
+Split* allocSplit(Setup* s, Channel* c) {
+    /* adds a split to a channel, 0 if it has SPLIT_MAX already */
+    Split* sp;
+    if (c->numSplits == SPLIT_MAX) {
+        return 0;
+    }
+    if (!c->splits && !(c->splits = (Split*)arenaAlloc(&s->arena, SPLIT_MAX * sizeof(Split)))) {
+        return 0;
     }
-    printf("channel %ld - failed to set controller table\n", in);
+    sp = &c->splits[c->numSplits++];
+    sp->output  = c->output;
+    sp->keyHigh = 127;
+    sp->velLow  = 1;
+    sp->velHigh = 127;
+    return sp;
 }
 
 /**************************************************************************/
 
-void parseCtrlRange(FILE* file, char* buffer, sint32 in) {
-    Table* table   = 0;
-    sint32 ctrlNum = 0;
-    if (readWord(file, buffer)) {
-        if (sscanf(buffer, "%ld", &ctrlNum)==1) {
-            if (readWord(file, buffer)) {
-                if (table = findTable(buffer)) {
-                    channels[in - 1].controlRangeMap[ctrlNum] = table->data;
-                    return;
-                }
+static bool rangeValue(Lexer* lx, uint8* low, uint8* high, sint32 min, const char* what) {
+    /* reads a <low> <high> pair */
+    if (!expectInteger(lx, min, 127, what)) {
+        return false;
+    }
+    *low = lx->value;
+    if (!expectInteger(lx, *low, 127, what)) {
+        return false;
+    }
+    *high = lx->value;
+    return true;
+}
+
+bool parseSplit(Lexer* lx, sint32 in) {
+    /*
+        split: <output channel> {
+            keys:       <low> <high>
+            velocities: <low> <high>
+            transpose:  <semitones>
+            velocity:   <table>
+        }
+    */
+    Channel* c = &building->channels[in - 1];
+    Split*   sp;
+    if (!expectInteger(lx, 1, MIDI_NUM_CHANNELS, "output channel")) {
+        return false;
+    }
+    if (!(sp = allocSplit(building, c))) {
+        return lexError(lx, "channel %ld has more than %d splits", (long)in, SPLIT_MAX);
+    }
+    sp->output = lx->value - 1;
+    if (!expectToken(lx, TOK_LBRACE, "'{'")) {
+        return false;
+    }
+    printf("Define split %ld -> %ld\n", (long)in, (long)sp->output + 1);
+    for (;;) {
+        if (!nextToken(lx)) {
+            return false;
+        }
+        if (lx->type == TOK_RBRACE) {
+            return true;
+        }
+        if (lx->type == TOK_WORD && strcmp(lx->word, "keys:") == 0) {
+            if (!rangeValue(lx, &sp->keyLow, &sp->keyHigh, 0, "key")) {
+                return false;
             }
         }
+        else if (lx->type == TOK_WORD && strcmp(lx->word, "velocities:") == 0) {
+            if (!rangeValue(lx, &sp->velLow, &sp->velHigh, 1, "velocity")) {
+                return false;
+            }
+        }
+        else if (lx->type == TOK_WORD && strcmp(lx->word, "transpose:") == 0) {
+            if (!expectInteger(lx, -127, 127, "transpose")) {
+                return false;
+            }
+            sp->transpose = lx->value;
+        }
+        else if (lx->type == TOK_WORD && strcmp(lx->word, "velocity:") == 0) {
+            if (!(sp->velocityMap = tableRef(lx))) {
+                return false;
+            }
+        }
+        else if (lx->type == TOK_END) {
+            return lexError(lx, "missing '}' for split");
+        }
+        else {
+            return lexError(lx, "expected keys:, velocities:, transpose:, velocity: or '}', found '%s'", lx->word);
+        }
     }
-    printf("channel %ld - failed to set controller range table\n", in);
 }
 
 /**************************************************************************/
 
-void parseCtrlInit(FILE* file, char* buffer, sint32 in) {
-    Table* table = 0;
-    sint32 ctrlNum;
-    sint32 ctrlVal;
-    if (readWord(file, buffer)) {
-        if (sscanf(buffer, "%ld", &ctrlNum) == 1) {
-            /* controller number specified. try to get value  */
-            if (readWord(file, buffer)) {
-                if (sscanf(buffer, "%ld", &ctrlVal) == 1) {
-                    /* if no table exists, attempt allocate it now */
-                    if (!(channels[in - 1].controlInit)) {
-                        if ( (table = allocTable(0)) ) {
-                            int j;
-                            for (j = 0; j < MIDI_NUM_CONTROLLERS; j++) {
-                                table->data[j]=0xFF;
-                            }
-                            addTable(table);
-                            channels[in - 1].controlInit = table->data;
-                            channels[in - 1].controlInit[ctrlNum] = ctrlVal;
-                            return;
-                        }
-                    }
-                    else {
-                        channels[in - 1].controlInit[ctrlNum] = ctrlVal;
-                        return;
-                    }
-                }
-            }
+bool parsePressure(Lexer* lx, sint32 in) {
+    return (building->channels[in - 1].pressureMap = tableRef(lx)) != 0;
+}
+
+/**************************************************************************/
+
+BendCurve* allocBendCurve(Setup* s, Channel* c) {
+    /* gives a channel an empty bend curve, replacing any it had */
+    if (!c->bendCurve && !(c->bendCurve = (BendCurve*)arenaAlloc(&s->arena, sizeof(BendCurve)))) {
+        return 0;
+    }
+    c->bendCurve->numPoints = 0;
+    return c->bendCurve;
+}
+
+/**************************************************************************/
+
+bool parseBend(Lexer* lx, sint32 in) {
+    /* bend: { <in>:<out> ... }, 2 to BEND_POINTS points with ascending input */
+    BendCurve* b;
+    if (!expectToken(lx, TOK_LBRACE, "'{'")) {
+        return false;
+    }
+    if (!(b = allocBendCurve(building, &building->channels[in - 1]))) {
+        return lexError(lx, "unable to allocate bend curve");
+    }
+    for (;;) {
+        if (!nextToken(lx)) {
+            return false;
+        }
+        if (lx->type == TOK_RBRACE) {
+            break;
+        }
+        if (lx->type != TOK_PAIR) {
+            return lexError(lx, "expected input:output or '}', found '%s'", lx->type == TOK_END ? "end of file" : lx->word);
         }
-        else if ( (table = findTable(buffer)) ) {
-            /* an existing table was specified rather than a single controller num */
-            channels[in - 1].controlInit = table->data;
-            return;
+        if (b->numPoints == BEND_POINTS) {
+            return lexError(lx, "bend curve has more than %d points", BEND_POINTS);
         }
+        if (lx->value < 0 || lx->value > BEND_MAX || (b->numPoints && lx->value <= b->x[b->numPoints - 1])) {
+            return lexError(lx, "bend input must be 0..%d and ascending", BEND_MAX);
+        }
+        if (lx->value2 < 0 || lx->value2 > BEND_MAX) {
+            return lexError(lx, "bend output must be 0..%d", BEND_MAX);
+        }
+        b->x[b->numPoints]   = lx->value;
+        b->y[b->numPoints++] = lx->value2;
+    }
+    if (b->numPoints < 2) {
+        return lexError(lx, "bend curve needs at least 2 points");
+    }
+    return true;
+}
+
+/**************************************************************************/
+
+bool parseBendRange(Lexer* lx, sint32 in) {
+    /* bendrange: <input semitones> <output semitones>, keeps bends in tune */
+    BendCurve* b;
+    sint32     from, to;
+    if (!expectInteger(lx, 1, 96, "input bend range")) {
+        return false;
+    }
+    from = lx->value;
+    if (!expectInteger(lx, 1, 96, "output bend range")) {
+        return false;
+    }
+    to = lx->value;
+    if (!(b = allocBendCurve(building, &building->channels[in - 1]))) {
+        return lexError(lx, "unable to allocate bend curve");
     }
-    printf("channel %ld - failed to set initial controller table\n", in);
+    /* a straight line through the centre, clamped when compiled */
+    b->numPoints = 2;
+    b->x[0] = 0;
+    b->y[0] = BEND_CENTRE - BEND_CENTRE * from / to;
+    b->x[1] = BEND_MAX;
+    b->y[1] = BEND_CENTRE + (BEND_MAX - BEND_CENTRE) * from / to;
+    return true;
 }
 
 /***************************************************************************/
 
-bool loadSetup(const char* configFile) {
+Setup* loadSetup(const char* configFile) {
+    /* loads a complete setup, leaving the active one untouched */
+    Arena  arena = { 0 };
+    Setup* s;
+    bool   ok;
     initDirectives();
-    /* allocate the channels */
-    if (!(channels = allocChannels(tableList))) {
-        return false;
+    /* the setup is the first thing in its own arena */
+    if (!(s = (Setup*)arenaAlloc(&arena, sizeof(Setup)))) {
+        return 0;
+    }
+    s->arena = arena;
+    if (isSetupImage(configFile)) {
+        ok = loadSetupImage(s, configFile);
     }
-    return parseSetup(configFile);
+    else {
+        building    = s;
+        usedDefault = false;
+        ok = parseSetup(configFile);
+        /* a config without ports uses the default one */
+        ok = ok && (s->numPorts || addDefaultPort(s));
+        building    = 0;
+    }
+    if (!(ok && compileSetup(s))) {
+        freeSetup(s);
+        return 0;
+    }
+    reportArena(&s->arena);
+    return s;
 }
 
 /**************************************************************************/
 
-void freeSetup(void) {
-    /* frees the entire list of tables */
-    Table* t;
-    Table* next;
-    int    i = 0;
+void freeSetup(Setup* s) {
+    /* frees the image and the arena holding everything else, the setup included */
+    if (!s) {
+        return;
+    }
     puts("\nfreeSetup()...");
-    for (t = tableList; t; i++) {
-        next = t->next;
-        printf("freeing table %d [hash: 0x%08X]\n", i, (unsigned)t->idHash);
-        freeTable(t);
-        t = next;
-    }
-    if (channels) {
-        freeChannels(channels);
-    }
-    tableList  = 0;
-    channels   = 0;
-    directives = 0;
+    freeSetupImage(s);
+    freeArena(&s->arena);
     puts("\ndone");
 }
 
 /**************************************************************************/
 
+Setup* useSetup(Setup* s) {
+    /*
+        Makes s the active setup and returns the previous one. Only the
+        pointers change here, so it is safe to call between any two
+        messages. The program state of each channel carries over so that
+        a reload does not disturb a performance.
+    */
+    Setup* old = setup;
+    if (old && s) {
+        sint32 i, j, k;
+        for (i = 0; i < s->numPorts; i++) {
+            /* a port carries on from the one with the same clusters */
+            Port* to = &s->ports[i];
+            for (j = 0; j < old->numPorts; j++) {
+                Port* from = &old->ports[j];
+                if (strcmp(to->inName, from->inName) == 0 && strcmp(to->outName, from->outName) == 0) {
+                    for (k = 0; k < MIDI_NUM_CHANNELS; k++) {
+                        carryChannelState(&to->channels[k], &from->channels[k]);
+                    }
+                    break;
+                }
+            }
+        }
+    }
+    setup    = s;
+    channels = s ? s->channels : 0;
+    return old;
+}
+
+/**************************************************************************/
+
+static void countMessage(ChannelTraffic* t, const uint8* msg) {
+    switch (msg[0] & 0xF0) {
+        case MS_NOTEON:
+            if (msg[2]) {
+                t->notes++;
+            }
+            break;
+        case MS_CTRL:
+            t->ctrls[msg[1] & 0x7F]++;
+            break;
+        case MS_PROG:
+            t->progs++;
+            break;
+        case MS_POLYPRESS:
+        case MS_CHANPRESS:
+        case MS_PITCHBEND:
+            t->other++;
+            break;
+    }
+}
+
+void countRemap(const uint8* sBuf, const uint8* dBuf, sint32 len) {
+    /* counts a remapped message and its output, if it is a channel message */
+    if (sBuf[0] < MS_SYSEX) {
+        /* channel messages out are always complete, with a status byte */
+        sint32 i;
+        countMessage(&traffic.in[sBuf[0] & 0x0F], sBuf);
+        for (i = 0; i < len; i += ((dBuf[i] & 0xE0) == MS_PROG) ? 2 : 3) {
+            countMessage(&traffic.out[dBuf[i] & 0x0F], dBuf + i);
+        }
+    }
+}
+
 sint32 remapMIDIData(uint8* dBuf, uint8* sBuf, sint32 sLen) {
-    sint32   dLen = sLen;
-    sint32   cmd  = (sBuf[0]) & 0xF0;
-    sint32   in   = (sBuf[0]) & 0x0F;
-    Channel* out  = &channels[in];
-    switch (cmd) {
-        case MS_NOTEOFF:
-        case MS_NOTEON: {
-            sint32 key = sBuf[1];
-            sint32 vel = sBuf[2];
-            if (out->noteMap[out->currProgIn]) {
-                /* unique key remap for this program# ? */
-                key = (out->noteMap[out->currProgIn])[key];
+    /* dispatches to the compiled handler for this channel and status */
+    Channel* c = &channels[sBuf[0] & 0x0F];
+    sint32   len = c->remap[(sBuf[0] >> 4) & 7](c, dBuf, sBuf, sLen);
+    countRemap(sBuf, dBuf, len);
+    return len;
+}
+
+/**************************************************************************/
+
+sint32 statusDataLength(sint32 status) {
+    /* number of data bytes that follow a status byte */
+    if (status < MS_SYSEX) {
+        return ((status & 0xE0) == MS_PROG) ? 1 : 2;
+    }
+    switch (status) {
+        case MS_QTRFRAME:
+        case MS_SONGSELECT:
+            return 1;
+        case MS_SONGPOS:
+            return 2;
+    }
+    return 0;
+}
+
+/**************************************************************************/
+
+void initRemapStream(RemapStream* rs) {
+    rs->status = 0;
+    rs->need   = 0;
+    rs->have   = 0;
+}
+
+/**************************************************************************/
+
+sint32 remapMIDIStream(RemapStream* rs, uint8* dBuf, sint32 dLen, uint8* sBuf, sint32* sLen) {
+    /*
+        Remaps an arbitrary run of MIDI bytes in one pass. Running status is
+        expanded, realtime bytes are passed straight through wherever they
+        occur and SysEx is passed on through its rules. Messages split
+        across calls are carried over in the stream state. Stops early if
+        the output buffer could not hold another remapped message; on
+        return *sLen holds the number of source bytes consumed. Returns the
+        bytes written.
+    */
+    uint8* d    = dBuf;
+    uint8* dEnd = dBuf + dLen - REMAP_MAX_OUTPUT;
+    uint8* s    = sBuf;
+    uint8* sEnd = sBuf + *sLen;
+    while (s < sEnd && d <= dEnd) {
+        sint32 b = *s++;
+        if (b >= MS_CLOCK) {
+            /* realtime never disturbs the running status */
+            if (b == MS_RESET) {
+                clearShadow();
             }
-            else {
-                /* defualt transpose for this program# ? */
-                key += out->currTrans;
-            }
-            if (out->velocityMap && vel!=0) {
-                /* velocity map for this channel# ? */
-                vel = out->velocityMap[vel];
-            }
-            dBuf[0] = cmd | out->output;
-            dBuf[1] = key;
-            dBuf[2] = vel;
-            dLen = 3;
-        }
-        break;
-
-        case MS_PROG: {
-            sint32 i    = 0;
-            sint32 prg = out->currProgIn = sBuf[1];
-            if (out->progTransMap) {
-                /* defualt transpose for this program# ? */
-                out->currTrans = out->progTransMap[prg];
-            }
-            if (out->progBankMSBMap) {
-                /* default bank MSB for this program# ? */
-                dBuf[i++] = MS_CTRL | out->output;
-                dBuf[i++] = 0;
-                dBuf[i++] = out->progBankMSBMap[prg];
-/*
-                printf(
-                    "MSB : 0x%02X 0x%02X 0x%02X : ",
-                    (unsigned)(dBuf[i - 3]),
-                    (unsigned)(dBuf[i - 2]),
-                    (unsigned)(dBuf[i - 1])
-                );
-*/
+            *d++ = b;
+        }
+        else if (b & 0x80) {
+            if (rs->status == MS_SYSEX) {
+                /* terminated by EOX, or unterminated */
+                d += endSysEx(&rs->sysex, d);
+                *d++       = MS_EOX;
+                rs->status = 0;
+                if (b == MS_EOX) {
+                    continue;
+                }
             }
-            if (out->progBankLSBMap) {
-                /* default bank LSB for this program# ? */
-                dBuf[i++] = MS_CTRL | out->output;
-                dBuf[i++] = 32;
-                dBuf[i++] = out->progBankLSBMap[prg];
-/*
-                printf(
-                    "LSB : 0x%02X 0x%02X 0x%02X : ",
-                    (unsigned)(dBuf[i - 3]),
-                    (unsigned)(dBuf[i - 2]),
-                    (unsigned)(dBuf[i - 1])
-                );
-*/
+            if (b == MS_SYSEX) {
+                rs->status = MS_SYSEX;
+                *d++       = b;
+                startSysEx(&rs->sysex);
+                continue;
             }
-            if (out->programMap) {
-                prg = out->programMap[prg];
+            rs->msg[0] = b;
+            rs->have   = 1;
+            rs->need   = statusDataLength(b);
+            /* system common cancels running status */
+            rs->status = b < MS_SYSEX ? b : 0;
+            if (!rs->need && b >= MS_SYSEX) {
+                if (b != MS_EOX) {
+                    *d++ = b;
+                }
+                rs->have = 0;
             }
-            dBuf[i++] = MS_PROG | out->output;
-            dBuf[i++] = prg;
-/*
-            printf(
-                "PC : 0x%02X 0x%02X\n",
-                (unsigned)(dBuf[i - 2]),
-                (unsigned)(dBuf[i - 1])
-            );
-*/
-            dLen = i;
         }
-        break;
-
-        case MS_CTRL: {
-            sint32 ctl = sBuf[1];
-            sint32 val = sBuf[2];
-            if (out->controlMap[ctl]) {
-                /* control# remap for this channel# ? */
-                ctl = out->controlMap[ctl];
+        else if (rs->status == MS_SYSEX) {
+            d += sysexData(&rs->sysex, d, b);
+        }
+        else if (rs->have || rs->status) {
+            if (!rs->have) {
+                /* running status */
+                rs->msg[0] = rs->status;
+                rs->have   = 1;
             }
-            if (out->controlRangeMap[ctl]) {
-                /* range map for this (remapped) control# ? */
-                val = (out->controlRangeMap[ctl])[val];
+            rs->msg[rs->have++] = b;
+            if (rs->have > rs->need) {
+                d += remapMIDIData(d, rs->msg, rs->have);
+                rs->have = 0;
             }
-            dBuf[0] = MS_CTRL | out->output;
-            dBuf[1] = ctl;
-            dBuf[2] = val;
-            dLen    = 3;
         }
-        break;
+    }
+    *sLen = s - sBuf;
+    return d - dBuf;
+}
 
-        default: {
-          /* copy message */
-          while (sLen--) {
-            *dBuf++ = *sBuf++;
-          }
+/**************************************************************************/
+
+sint32 compressRunningStatus(uint8* running, uint8* buf, sint32 len) {
+    /*
+        Drops status bytes that repeat the running status of an output link,
+        in place. A note off that would break a note on run is sent as a
+        note on with velocity 0 instead. Realtime bytes leave the running
+        status alone, any other system message cancels it. *running holds
+        the last status sent on the link. Returns the new length.
+    */
+    uint8* s   = buf;
+    uint8* d   = buf;
+    uint8* end = buf + len;
+    while (s < end) {
+        sint32 b = *s++;
+        if (b < 0x80 || b >= MS_CLOCK) {
+            *d++ = b;
+        }
+        else if (b >= MS_SYSEX) {
+            *running = 0;
+            *d++     = b;
+        }
+        else if (b == *running) {
+            /* repeated status */
+        }
+        else if (
+            (b & 0xF0) == MS_NOTEOFF && *running == (MS_NOTEON | (b & 0x0F)) &&
+            end - s >= 2 && s[0] < 0x80 && s[1] < 0x80
+        ) {
+            *d++ = s[0];
+            *d++ = 0;
+            s   += 2;
+        }
+        else {
+            *running = b;
+            *d++     = b;
         }
-        break;
     }
-    return dLen; /* bytes written */
+    return d - buf;
 }
@@ -0,0 +1,765 @@
+/*
+    Standard MIDI File remapping
+
+    Every track of a type 0 or type 1 file (or type 2) is run through the
+    loaded setup and written out as a new file. Delta times are kept as
+    they were. When one event remaps to several messages, as a program
+    change does with its bank selects, the extra messages follow with a
+    delta of 0, so they fall on the same tick. An event that remaps to
+    nothing hands its delta on to the next event.
+
+    Both files are streamed through fixed buffers, so a file of any size is
+    converted in one pass. Each track's length is patched into its chunk
+    header once the track has been written.
+
+    Tracks are remapped through the first port, each starting from the
+    channel state the setup had when loaded. Meta events are copied as they
+    are; SysEx events go through the SysEx rules, which never change their
+    length. Chunks other than tracks are copied.
+
+    Channel events are gathered into blocks and remapped a block at a time
+    with remapBlock(). A block is written out before any meta or SysEx
+    event, so the order of events in the track never changes.
+*/
+
+#include "midimapper.h"
+#include <string.h>
+
+extern Setup*              setup;
+extern TASK_LOCAL Channel* channels;
+
+#define SMF_BUFFER 8192
+
+#define META_END_OF_TRACK 0x2F
+
+typedef struct {
+    FILE*       file;
+    const char* name;
+    uint8*      pos;
+    uint8*      end;
+    uint32      left;                             /* bytes left in the chunk */
+    uint32      events;                           /* track events read */
+    bool        error;
+    uint8       buf[SMF_BUFFER];
+} SMFReader;
+
+typedef struct {
+    FILE*       file;
+    const char* name;
+    uint32      len;                              /* bytes waiting in buf */
+    uint32      chunkLen;                         /* bytes of the current chunk */
+    long        chunkPos;                         /* offset of its length field */
+    bool        error;
+    uint8       buf[SMF_BUFFER];
+} SMFWriter;
+
+typedef struct {
+    EventBlock  block;                            /* channel events not yet remapped */
+    uint32      delta[BLOCK_EVENTS];              /* delta time read before each */
+    BlockPlan   plan;
+    uint8       out[BLOCK_EVENTS * REMAP_MAX_OUTPUT];
+} TrackBlock;
+
+/**************************************************************************/
+
+static bool smfError(SMFReader* r, const char* what) {
+    /* reports the first error in the input, always returns false */
+    if (!r->error) {
+        printf("*** %s: %s\n", r->name, what);
+        r->error = true;
+    }
+    return false;
+}
+
+static bool moreInput(SMFReader* r) {
+    /* refills the buffer if it is empty, false at the end of the file */
+    sint32 n;
+    if (r->pos < r->end) {
+        return true;
+    }
+    n      = fread(r->buf, 1, SMF_BUFFER, r->file);
+    r->pos = r->buf;
+    r->end = r->buf + (n > 0 ? n : 0);
+    return n > 0;
+}
+
+static sint32 readByte(SMFReader* r) {
+    /* next byte of the current chunk, 0 once anything has gone wrong */
+    if (r->error) {
+        return 0;
+    }
+    if (!r->left) {
+        smfError(r, "event runs past the end of its track");
+        return 0;
+    }
+    if (!moreInput(r)) {
+        smfError(r, "file is truncated");
+        return 0;
+    }
+    r->left--;
+    return *r->pos++;
+}
+
+static uint32 readVarLen(SMFReader* r) {
+    /* variable length quantity, at most 4 bytes */
+    uint32 v = 0;
+    sint32 i, b;
+    for (i = 0; i < 4; i++) {
+        b = readByte(r);
+        v = (v << 7) | (b & 0x7F);
+        if (!(b & 0x80)) {
+            return v;
+        }
+    }
+    smfError(r, "variable length quantity is too long");
+    return 0;
+}
+
+static uint32 readLong(SMFReader* r) {
+    uint32 v = readByte(r) << 24;
+    v |= readByte(r) << 16;
+    v |= readByte(r) << 8;
+    return v | readByte(r);
+}
+
+/**************************************************************************/
+
+static void flushWriter(SMFWriter* w) {
+    if (w->len && !w->error && fwrite(w->buf, 1, w->len, w->file) != w->len) {
+        printf("*** unable to write %s\n", w->name);
+        w->error = true;
+    }
+    w->len = 0;
+}
+
+static void putByte(SMFWriter* w, sint32 b) {
+    if (w->len == SMF_BUFFER) {
+        flushWriter(w);
+    }
+    w->buf[w->len++] = b;
+    w->chunkLen++;
+}
+
+static void putBytes(SMFWriter* w, const uint8* b, sint32 len) {
+    while (len--) {
+        putByte(w, *b++);
+    }
+}
+
+static void putVarLen(SMFWriter* w, uint32 v) {
+    uint8  b[4];
+    sint32 n = 0;
+    do {
+        b[n++] = v & 0x7F;
+        v    >>= 7;
+    } while (v && n < 4);
+    while (--n) {
+        putByte(w, b[n] | 0x80);
+    }
+    putByte(w, b[0]);
+}
+
+static void putLong(SMFWriter* w, uint32 v) {
+    putByte(w, v >> 24);
+    putByte(w, v >> 16);
+    putByte(w, v >> 8);
+    putByte(w, v);
+}
+
+/**************************************************************************/
+
+static void startChunk(SMFWriter* w, const uint8* id) {
+    /* writes a chunk header, the length is filled in by endChunk() */
+    putBytes(w, id, 4);
+    flushWriter(w);
+    w->chunkPos = ftell(w->file);
+    putLong(w, 0);
+    w->chunkLen = 0;
+}
+
+static void endChunk(SMFWriter* w) {
+    uint8 len[4];
+    flushWriter(w);
+    if (w->error) {
+        return;
+    }
+    len[0] = w->chunkLen >> 24;
+    len[1] = w->chunkLen >> 16;
+    len[2] = w->chunkLen >> 8;
+    len[3] = w->chunkLen;
+    if (
+        fseek(w->file, w->chunkPos, SEEK_SET) || fwrite(len, 1, 4, w->file) != 4 ||
+        fseek(w->file, 0, SEEK_END)
+    ) {
+        printf("*** unable to write %s\n", w->name);
+        w->error = true;
+    }
+}
+
+static void copyBytes(SMFReader* r, SMFWriter* w, uint32 len) {
+    while (len-- && !r->error) {
+        putByte(w, readByte(r));
+    }
+}
+
+/**************************************************************************/
+
+static void remapSysExEvent(SMFReader* r, SMFWriter* w, sint32 type) {
+    /*
+        F0 events go through the SysEx rules up to their F7. A message
+        divided over several events is left as it was from the end of the
+        first one, and F7 escapes are copied.
+    */
+    SysExState sx;
+    uint8      d[2];
+    uint32     len = readVarLen(r);
+    bool       inside = type == MS_SYSEX;
+    putByte(w, type);
+    putVarLen(w, len);
+    startSysEx(&sx);
+    while (len-- && !r->error) {
+        sint32 b = readByte(r);
+        if (!inside) {
+            putByte(w, b);
+        }
+        else if (b < 0x80) {
+            putBytes(w, d, sysexData(&sx, d, b));
+        }
+        else {
+            putBytes(w, d, endSysEx(&sx, d));
+            putByte(w, b);
+            inside = false;
+        }
+    }
+    if (inside && sx.holding) {
+        putByte(w, sx.held);
+    }
+}
+
+/**************************************************************************/
+
+static void flushBlock(TrackBlock* tb, SMFWriter* w, bool compress, uint32* delta, uint8* running) {
+    /* remaps the gathered channel events and writes out what they became */
+    sint32 i, j, n;
+    remapBlock(&tb->plan, &tb->block, tb->out);
+    for (i = j = 0; i < tb->block.count; i++) {
+        *delta += tb->delta[i];
+        for (; j < tb->block.end[i]; j += n) {
+            /* one message per event, all at the tick of the original */
+            n = ((tb->out[j] & 0xE0) == MS_PROG) ? 2 : 3;
+            putVarLen(w, *delta);
+            putBytes(w, tb->out + j, compress ? compressRunningStatus(running, tb->out + j, n) : n);
+            *delta = 0;
+        }
+    }
+    tb->block.count = 0;
+}
+
+static bool remapTrack(SMFReader* r, SMFWriter* w, bool compress) {
+    /* remaps the events of one track, the reader holds the chunk length */
+    static TASK_LOCAL TrackBlock tb;
+    EventBlock* b       = &tb.block;
+    uint32      delta   = 0;                      /* owed to the next event written */
+    uint8       status  = 0;                      /* running status in */
+    uint8       running = 0;                      /* running status out */
+    initBlockPlan(&tb.plan, true);
+    b->count = 0;
+    while (r->left && !r->error) {
+        uint32 step = readVarLen(r);
+        sint32 d, n = readByte(r);
+        r->events++;
+        if (n == 0xFF || n == MS_SYSEX || n == MS_EOX) {
+            /* the channel events before it go out first */
+            flushBlock(&tb, w, compress, &delta, &running);
+            putVarLen(w, delta + step);
+            delta  = 0;
+            status = running = 0;
+            if (n != 0xFF) {
+                remapSysExEvent(r, w, n);
+                continue;
+            }
+            putByte(w, n);
+            putByte(w, d = readByte(r));
+            n = readVarLen(r);
+            putVarLen(w, n);
+            copyBytes(r, w, n);
+            if (d == META_END_OF_TRACK) {
+                /* anything after it is not part of the track */
+                while (r->left && !r->error) {
+                    readByte(r);
+                }
+                return !r->error;
+            }
+            continue;
+        }
+        if (n & 0x80) {
+            if (n > MS_PITCHBEND + 0x0F) {
+                return smfError(r, "system message in a track");
+            }
+            status = n;
+            n      = readByte(r);
+        }
+        else if (!status) {
+            return smfError(r, "data byte without a status");
+        }
+        d = (status & 0xE0) != MS_PROG ? readByte(r) : 0;
+        if ((n | d) & 0x80) {
+            return smfError(r, "status byte inside a message");
+        }
+        b->status[b->count] = status;
+        b->data1[b->count]  = n;
+        b->data2[b->count]  = d;
+        tb.delta[b->count]  = step;
+        if (++b->count == BLOCK_EVENTS) {
+            flushBlock(&tb, w, compress, &delta, &running);
+        }
+    }
+    if (!r->error) {
+        /* the track had no end, give it one */
+        flushBlock(&tb, w, compress, &delta, &running);
+        putVarLen(w, delta);
+        putByte(w, 0xFF);
+        putByte(w, META_END_OF_TRACK);
+        putByte(w, 0);
+    }
+    return !r->error;
+}
+
+/**************************************************************************/
+
+static sint32 convertSMF(const char* inName, const char* outName, bool compress, uint32* events) {
+    /* remaps a file through the active channels, returns the tracks or -1 */
+    static TASK_LOCAL SMFReader r;
+    static TASK_LOCAL SMFWriter w;
+    static TASK_LOCAL Channel   start[MIDI_NUM_CHANNELS];
+    static const uint8 trackId[4] = { 'M', 'T', 'r', 'k' };
+    uint8  id[4];
+    uint32 len;
+    sint32 format, tracks = 0;
+    r.name   = inName;
+    r.error  = false;
+    r.events = 0;
+    r.pos    = r.end = r.buf;
+    w.name   = outName;
+    w.error  = false;
+    w.len    = 0;
+    if (!(r.file = fopen(inName, "rb"))) {
+        printf("*** unable to open %s\n", inName);
+        return -1;
+    }
+    if (!(w.file = fopen(outName, "wb"))) {
+        printf("*** unable to create %s\n", outName);
+        fclose(r.file);
+        return -1;
+    }
+
+    /* header chunk */
+    r.left = 8;
+    for (len = 0; len < 4; len++) {
+        id[len] = readByte(&r);
+    }
+    r.left = readLong(&r);
+    if (r.error || memcmp(id, "MThd", 4) || r.left < 6) {
+        smfError(&r, "not a Standard MIDI File");
+    }
+    else if ((format = readByte(&r)) || (format = readByte(&r)) > 2) {
+        smfError(&r, "unknown SMF format");
+    }
+    else {
+        startChunk(&w, id);
+        putByte(&w, 0);
+        putByte(&w, format);
+        copyBytes(&r, &w, r.left);
+        endChunk(&w);
+    }
+
+    /* every track starts from the state of the freshly loaded setup */
+    memcpy(start, channels, sizeof(start));
+    while (!r.error && !w.error && moreInput(&r)) {
+        r.left = 8;
+        for (len = 0; len < 4; len++) {
+            id[len] = readByte(&r);
+        }
+        r.left = readLong(&r);
+        if (r.error) {
+            break;
+        }
+        startChunk(&w, id);
+        if (memcmp(id, trackId, 4)) {
+            copyBytes(&r, &w, r.left);
+        }
+        else {
+            memcpy(channels, start, sizeof(start));
+            clearShadow();
+            remapTrack(&r, &w, compress);
+            tracks++;
+        }
+        endChunk(&w);
+    }
+    memcpy(channels, start, sizeof(start));
+    flushWriter(&w);
+    fclose(w.file);
+    fclose(r.file);
+    *events = r.events;
+    return r.error || w.error ? -1 : tracks;
+}
+
+/**************************************************************************/
+
+bool remapSMFFile(const char* inName, const char* outName, bool compress) {
+    /* remaps a Standard MIDI File, compress uses running status in the output */
+    uint32 events;
+    sint32 tracks = convertSMF(inName, outName, compress, &events);
+    if (tracks < 0) {
+        return false;
+    }
+    printf("remapped %ld tracks from %s to %s\n", (long)tracks, inName, outName);
+    return true;
+}
+
+/**************************************************************************/
+
+#ifdef MIDIMAPPER_HOST
+/*
+    Batch conversion (host build)
+
+    A directory of files, or a text file listing one per line, is converted
+    by a pool of worker processes. They share the loaded setup, which is
+    only read while remapping; each worker remaps through a copy of the
+    first port's channels and a controller record of its own, so the
+    running program and note state of one file never leaks into another.
+
+    Files are taken largest first. Each worker starts with its own range of
+    the list, dealt so that every worker begins on one of the biggest files,
+    and takes files from the front of it. A worker whose range runs out
+    steals the back half of the fullest range it can find, so a few huge
+    files occupy a few workers while the rest carry on with everything else.
+    A range is one 64 bit word, start and end, changed only by compare and
+    swap, so owner and thieves never lock.
+*/
+#include <dirent.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <dos/dostags.h>
+
+#define BATCH_WORKERS 64
+#define BATCH_PATH    1024
+
+typedef struct {
+    char*  path;
+    uint32 size;                                  /* bytes, for ordering */
+} BatchFile;
+
+typedef struct {
+    uint64 range;                                 /* next << 32 | end, into order[] */
+    uint8  pad[64 - sizeof(uint64)];
+} BatchRange;
+
+static BatchFile*       batchFiles  = 0;
+static sint32           numBatch    = 0;
+static sint32*          batchOrder  = 0;
+static BatchRange       batchRange[BATCH_WORKERS];
+static sint32           numWorkers  = 0;
+static const char*      batchOut    = 0;
+static bool             batchCompress;
+static struct Task*     batchTask   = 0;
+static sint32           batchSig    = -1;
+static volatile sint32  workersNext = 0;           /* worker index to hand out */
+static volatile sint32  workersRunning = 0;
+static volatile uint32  batchDone   = 0;
+static volatile uint32  batchFailed = 0;
+static volatile uint64  batchEvents = 0;
+
+/**************************************************************************/
+
+static bool hasMidiSuffix(const char* name) {
+    const char* dot = strrchr(name, '.');
+    return dot && (!strcasecmp(dot, ".mid") || !strcasecmp(dot, ".smf"));
+}
+
+static bool addBatchFile(const char* path, sint32 max) {
+    /* notes a file to convert, with its size */
+    struct stat st;
+    sint32      len = strlen(path);
+    if (stat(path, &st) || !S_ISREG(st.st_mode)) {
+        printf("*** skipping %s, not a file\n", path);
+        return true;
+    }
+    if (numBatch == max || !(batchFiles[numBatch].path = (char*)AllocMem(len + 1, MEMF_PUBLIC))) {
+        puts("*** too many files");
+        return false;
+    }
+    memcpy(batchFiles[numBatch].path, path, len + 1);
+    batchFiles[numBatch++].size = st.st_size;
+    return true;
+}
+
+static const char* batchName(const BatchFile* f) {
+    /* the name the output is written under, the file name without its directory */
+    const char* name = strrchr(f->path, '/');
+    return name ? name + 1 : f->path;
+}
+
+static int byName(const void* a, const void* b) {
+    return strcmp(batchName((const BatchFile*)a), batchName((const BatchFile*)b));
+}
+
+static bool uniqueNames(void) {
+    /* false if two files would be written to the same output file */
+    sint32 i;
+    bool   ok = true;
+    qsort(batchFiles, numBatch, sizeof(BatchFile), byName);
+    for (i = 1; i < numBatch; i++) {
+        if (!strcmp(batchName(&batchFiles[i - 1]), batchName(&batchFiles[i]))) {
+            printf("*** %s and %s would both be written to %s/%s\n",
+                batchFiles[i - 1].path, batchFiles[i].path, batchOut, batchName(&batchFiles[i]));
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+static bool scanBatch(const char* source, sint32 max) {
+    /* collects the files of a directory, or those named in a list file */
+    char   path[BATCH_PATH];
+    struct stat st;
+    if (stat(source, &st) == 0 && S_ISDIR(st.st_mode)) {
+        struct dirent* e;
+        DIR*           dir = opendir(source);
+        bool           ok  = true;
+        if (!dir) {
+            printf("*** unable to read %s\n", source);
+            return false;
+        }
+        while (ok && (e = readdir(dir))) {
+            if (hasMidiSuffix(e->d_name) && snprintf(path, BATCH_PATH, "%s/%s", source, e->d_name) < BATCH_PATH) {
+                ok = addBatchFile(path, max);
+            }
+        }
+        closedir(dir);
+        return ok;
+    }
+    else {
+        FILE* list = fopen(source, "r");
+        bool  ok   = true;
+        if (!list) {
+            printf("*** unable to open %s\n", source);
+            return false;
+        }
+        while (ok && fgets(path, BATCH_PATH, list)) {
+            path[strcspn(path, "\r\n")] = 0;
+            if (path[0]) {
+                ok = addBatchFile(path, max);
+            }
+        }
+        fclose(list);
+        /* a list may name files from different directories */
+        return ok && uniqueNames();
+    }
+}
+
+static sint32 countBatch(const char* source) {
+    /* upper bound on the number of files scanBatch() will find */
+    char   line[BATCH_PATH];
+    sint32 n = 0;
+    DIR*   dir;
+    FILE*  list;
+    if ((dir = opendir(source))) {
+        while (readdir(dir)) {
+            n++;
+        }
+        closedir(dir);
+    }
+    else if ((list = fopen(source, "r"))) {
+        while (fgets(line, BATCH_PATH, list)) {
+            n++;
+        }
+        fclose(list);
+    }
+    return n;
+}
+
+static int biggerFirst(const void* a, const void* b) {
+    uint32 sa = ((const BatchFile*)a)->size;
+    uint32 sb = ((const BatchFile*)b)->size;
+    return sa < sb ? 1 : sa > sb ? -1 : 0;
+}
+
+/**************************************************************************/
+
+static sint32 takeOwn(BatchRange* r) {
+    /* the next file of a worker's own range, -1 if it is empty */
+    uint64 v = __atomic_load_n(&r->range, __ATOMIC_ACQUIRE);
+    for (;;) {
+        uint32 next = (uint32)(v >> 32);
+        uint32 end  = (uint32)v;
+        if (next >= end) {
+            return -1;
+        }
+        if (__atomic_compare_exchange_n(
+            &r->range, &v, ((uint64)(next + 1) << 32) | end, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE
+        )) {
+            return batchOrder[next];
+        }
+    }
+}
+
+static bool stealRange(sint32 self) {
+    /* moves the back half of the fullest other range into our own */
+    for (;;) {
+        sint32 i, victim = -1;
+        uint32 most = 0;
+        uint64 v    = 0;
+        for (i = 0; i < numWorkers; i++) {
+            uint64 w = __atomic_load_n(&batchRange[i].range, __ATOMIC_ACQUIRE);
+            uint32 n = (uint32)w - (uint32)(w >> 32);
+            if (i != self && (uint32)(w >> 32) < (uint32)w && n > most) {
+                most   = n;
+                victim = i;
+                v      = w;
+            }
+        }
+        if (victim < 0) {
+            return false;
+        }
+        {
+            uint32 next = (uint32)(v >> 32);
+            uint32 end  = (uint32)v;
+            uint32 take = (end - next + 1) / 2;
+            if (__atomic_compare_exchange_n(
+                &batchRange[victim].range, &v, ((uint64)next << 32) | (end - take),
+                false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE
+            )) {
+                __atomic_store_n(&batchRange[self].range, ((uint64)(end - take) << 32) | end, __ATOMIC_RELEASE);
+                return true;
+            }
+        }
+    }
+}
+
+/**************************************************************************/
+
+void batchWorker(void) {
+    /* worker process entry, runs until there is nothing left to steal */
+    static TASK_LOCAL uint8 shadow[MIDI_NUM_CHANNELS * MIDI_NUM_CONTROLLERS];
+    char     path[BATCH_PATH];
+    uint32   done;
+    sint32   self = __atomic_fetch_add(&workersNext, 1, __ATOMIC_ACQ_REL);
+    Channel* own  = (Channel*)AllocMem(sizeof(Channel) * MIDI_NUM_CHANNELS, MEMF_PUBLIC);
+    if (own) {
+        memcpy(own, setup->channels, sizeof(Channel) * MIDI_NUM_CHANNELS);
+        channels = own;
+        useShadow(shadow);
+        for (;;) {
+            const char* name;
+            uint32      events = 0;
+            sint32      f      = takeOwn(&batchRange[self]);
+            if (f < 0) {
+                if (!stealRange(self)) {
+                    break;
+                }
+                continue;
+            }
+            name = batchName(&batchFiles[f]);
+            if (snprintf(path, BATCH_PATH, "%s/%s", batchOut, name) >= BATCH_PATH ||
+                convertSMF(batchFiles[f].path, path, batchCompress, &events) < 0) {
+                __atomic_add_fetch(&batchFailed, 1, __ATOMIC_RELAXED);
+            }
+            __atomic_add_fetch(&batchDone, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&batchEvents, events, __ATOMIC_RELAXED);
+        }
+        channels = 0;
+        FreeMem(own, sizeof(Channel) * MIDI_NUM_CHANNELS);
+    }
+    else {
+        puts("*** unable to allocate worker channels");
+    }
+    /* the signal may be freed as soon as the count reaches 0 */
+    done = 1L << batchSig;
+    __atomic_sub_fetch(&workersRunning, 1, __ATOMIC_RELEASE);
+    Signal(batchTask, done);
+}
+
+/**************************************************************************/
+
+bool remapSMFBatch(const char* source, const char* outDir, sint32 workers, bool compress) {
+    /* converts many files with a pool of workers, see above */
+    struct timespec t0, t1;
+    float64 secs;
+    sint32  max = countBatch(source);
+    sint32  i, j, k;
+    bool    ok  = false;
+    if (workers <= 0) {
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    numWorkers    = workers < 1 ? 1 : workers > BATCH_WORKERS ? BATCH_WORKERS : workers;
+    batchOut      = outDir;
+    batchCompress = compress;
+    batchTask     = FindTask(0);
+    numBatch      = 0;
+    if (!max) {
+        printf("*** nothing to convert in %s\n", source);
+        return false;
+    }
+    if (!(batchFiles = (BatchFile*)AllocMem(max * sizeof(BatchFile), MEMF_PUBLIC | MEMF_CLEAR)) ||
+        !(batchOrder = (sint32*)AllocMem(max * sizeof(sint32), MEMF_PUBLIC)) ||
+        (batchSig = AllocSignal(-1)) == -1) {
+        puts("*** unable to set up the batch");
+    }
+    else if (scanBatch(source, max)) {
+        /* deal the files, largest first, round the workers */
+        qsort(batchFiles, numBatch, sizeof(BatchFile), biggerFirst);
+        for (i = 0, k = 0; i < numWorkers; i++) {
+            uint32 start = k;
+            for (j = i; j < numBatch; j += numWorkers) {
+                batchOrder[k++] = j;
+            }
+            batchRange[i].range = ((uint64)start << 32) | k;
+        }
+        printf("converting %ld files with %ld workers\n", (long)numBatch, (long)numWorkers);
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        workersNext = 0;
+        for (i = 0; i < numWorkers; i++) {
+            __atomic_add_fetch(&workersRunning, 1, __ATOMIC_RELEASE);
+            if (!CreateNewProcTags(NP_Entry, batchWorker, NP_Name, "midimapper batch", TAG_DONE)) {
+                __atomic_sub_fetch(&workersRunning, 1, __ATOMIC_RELEASE);
+                printf("*** couldn't start worker %ld\n", (long)i);
+                /* the workers that did start steal its range */
+            }
+        }
+        while (__atomic_load_n(&workersRunning, __ATOMIC_ACQUIRE)) {
+            Wait(1L << batchSig);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        if (secs <= 0) {
+            secs = 1e-9;
+        }
+        printf(
+            "converted %lu files (%lu failed), %llu events in %.3fs: %.0f files/s, %.0f events/s\n",
+            (unsigned long)batchDone, (unsigned long)batchFailed, (unsigned long long)batchEvents,
+            secs, batchDone / secs, batchEvents / secs
+        );
+        ok = batchDone == (uint32)numBatch && !batchFailed;
+    }
+    if (batchSig != -1) {
+        FreeSignal(batchSig);
+        batchSig = -1;
+    }
+    for (i = 0; i < numBatch; i++) {
+        FreeMem(batchFiles[i].path, strlen(batchFiles[i].path) + 1);
+    }
+    if (batchOrder) {
+        FreeMem(batchOrder, max * sizeof(sint32));
+        batchOrder = 0;
+    }
+    if (batchFiles) {
+        FreeMem(batchFiles, max * sizeof(BatchFile));
+        batchFiles = 0;
+    }
+    return ok;
+}
+#endif
@@ -0,0 +1,256 @@
+/*
+    Latency statistics and traffic counters
+
+    Each packet is stamped with the E-clock as it is taken from the MDest
+    queue. When the output it produced has been handed to PutMidiStream(),
+    the elapsed time is added to the histogram for its message class.
+    midi.library packets carry no timestamp of their own, so the time a
+    packet spent queued before GetMidiPacket() is not included.
+
+    Buckets are logarithmic, four to each power of two of E-clock ticks,
+    so the bucket for a time is found with a few shifts. Everything is
+    static; nothing is allocated while running.
+
+    The traffic counters are plain increments made where messages are
+    remapped; printTraffic() prints a snapshot of them.
+*/
+
+#include "midimapper.h"
+#include <devices/timer.h>
+#include <proto/timer.h>
+
+#define STAT_BUCKETS 128 /* 4 per bit of a 32 bit tick count */
+#define STAT_PENDING 256 /* packets stamped but not yet sent */
+
+typedef struct {
+    uint32 count;
+    uint32 max;
+    uint32 bucket[STAT_BUCKETS];
+} Histogram;
+
+struct Device* TimerBase = 0;
+TASK_LOCAL Traffic traffic;                      /* of the remapping task */
+
+static struct timerequest timerReq;
+static uint32             eclockRate = 0;
+static Histogram          hist[STAT_CLASSES];
+static uint32             pendingTime[STAT_PENDING];
+static uint8              pendingClass[STAT_PENDING];
+static sint32             numPending = 0;
+
+static const char* className[STAT_CLASSES] = {
+    "note", "control", "program", "realtime", "other"
+};
+
+/**************************************************************************/
+
+bool openStats(void) {
+    /* opens timer.device for the E-clock, statistics are off without it */
+    struct EClockVal now;
+    if (OpenDevice(TIMERNAME, UNIT_ECLOCK, (struct IORequest*)&timerReq, 0) != 0) {
+        printf("Couldn't open %s, no latency statistics\n", TIMERNAME);
+        return false;
+    }
+    TimerBase  = timerReq.tr_node.io_Device;
+    eclockRate = ReadEClock(&now);
+    return true;
+}
+
+/**************************************************************************/
+
+void closeStats(void) {
+    if (TimerBase) {
+        CloseDevice((struct IORequest*)&timerReq);
+        TimerBase = 0;
+    }
+}
+
+/**************************************************************************/
+
+static sint32 statClass(sint32 status) {
+    if (status >= MS_CLOCK) {
+        return STAT_REALTIME;
+    }
+    switch (status & 0xF0) {
+        case MS_NOTEOFF:
+        case MS_NOTEON:
+            return STAT_NOTE;
+        case MS_CTRL:
+            return STAT_CTRL;
+        case MS_PROG:
+            return STAT_PROG;
+    }
+    return STAT_OTHER;
+}
+
+uint32 readStamp(void) {
+    /* low word of the E-clock, 0 without statistics */
+    struct EClockVal now;
+    if (!TimerBase) {
+        return 0;
+    }
+    ReadEClock(&now);
+    return now.ev_lo;
+}
+
+uint32 stampRate(void) {
+    /* E-clock ticks per second, 0 without statistics */
+    return TimerBase ? eclockRate : 0;
+}
+
+bool stampPacketAt(sint32 status, uint32 stamp) {
+    /* notes a packet that arrived at stamp, false if the pending list is full */
+    if (!TimerBase) {
+        return true;
+    }
+    if (numPending == STAT_PENDING) {
+        return false;
+    }
+    pendingTime[numPending]  = stamp;
+    pendingClass[numPending] = statClass(status);
+    numPending++;
+    return true;
+}
+
+bool stampPacket(sint32 status) {
+    /* notes the arrival of a packet, false if the pending list is full */
+    return stampPacketAt(status, readStamp());
+}
+
+/**************************************************************************/
+
+static sint32 bucketIndex(uint32 ticks) {
+    sint32 n = 2;
+    if (ticks < 4) {
+        return ticks;
+    }
+    while (ticks >> (n + 1)) {
+        n++;
+    }
+    return (n - 1) * 4 + ((ticks >> (n - 2)) & 3);
+}
+
+static uint32 bucketTop(sint32 index) {
+    /* largest tick count falling in a bucket */
+    sint32 n;
+    if (index < 4) {
+        return index;
+    }
+    n = index / 4 + 1;
+    return ((uint32)(4 + (index & 3)) << (n - 2)) + ((1UL << (n - 2)) - 1);
+}
+
+void recordLatency(void) {
+    /* called once the output of all pending packets has been sent */
+    struct EClockVal now;
+    sint32 i;
+    if (!numPending) {
+        return;
+    }
+    ReadEClock(&now);
+    for (i = 0; i < numPending; i++) {
+        Histogram* h = &hist[pendingClass[i]];
+        uint32     d = now.ev_lo - pendingTime[i];
+        h->count++;
+        h->bucket[bucketIndex(d)]++;
+        if (d > h->max) {
+            h->max = d;
+        }
+    }
+    numPending = 0;
+}
+
+/**************************************************************************/
+
+static float64 percentile(const Histogram* h, sint32 percent) {
+    /* upper bound of the bucket holding the given percentile, in us */
+    uint32 want = (uint32)(((float64)h->count * percent + 99) / 100);
+    uint32 seen = 0;
+    sint32 i;
+    for (i = 0; i < STAT_BUCKETS; i++) {
+        if ((seen += h->bucket[i]) >= want) {
+            break;
+        }
+    }
+    if (i == STAT_BUCKETS || bucketTop(i) > h->max) {
+        return h->max * 1000000.0 / eclockRate;
+    }
+    return bucketTop(i) * 1000000.0 / eclockRate;
+}
+
+void printStats(void) {
+    sint32 i;
+    if (!TimerBase) {
+        return;
+    }
+    printf("\nlatency (us)     count        p50        p99        max\n");
+    for (i = 0; i < STAT_CLASSES; i++) {
+        const Histogram* h = &hist[i];
+        if (!h->count) {
+            printf("%-10s %11lu          -          -          -\n", className[i], 0UL);
+            continue;
+        }
+        printf(
+            "%-10s %11lu %10.0f %10.0f %10.0f\n",
+            className[i], (unsigned long)h->count,
+            percentile(h, 50), percentile(h, 99), h->max * 1000000.0 / eclockRate
+        );
+    }
+}
+
+/**************************************************************************/
+
+static void printChannelTraffic(const char* dir, sint32 ch, const ChannelTraffic* t) {
+    sint32 i, n = 0;
+    printf(
+        "%s %2ld: notes %lu prog %lu other %lu pass %lu\n",
+        dir, (long)ch + 1, (unsigned long)t->notes, (unsigned long)t->progs,
+        (unsigned long)t->other, (unsigned long)t->passBytes
+    );
+    for (i = 0; i < MIDI_NUM_CONTROLLERS; i++) {
+        if (t->ctrls[i]) {
+            printf("%s cc%ld:%lu", n++ % 8 ? "" : "       ", (long)i, (unsigned long)t->ctrls[i]);
+            if (n % 8 == 0) {
+                printf("\n");
+            }
+        }
+    }
+    if (n % 8) {
+        printf("\n");
+    }
+}
+
+static bool hasTraffic(const ChannelTraffic* t) {
+    sint32 i;
+    if (t->notes || t->progs || t->other || t->passBytes) {
+        return true;
+    }
+    for (i = 0; i < MIDI_NUM_CONTROLLERS; i++) {
+        if (t->ctrls[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void printTraffic(const Traffic* t) {
+    /* prints a snapshot of the counters, channels with no traffic are left out */
+    static Traffic snap;
+    sint32 i;
+    snap = *t;
+    printf("\ntraffic\n");
+    for (i = 0; i < MIDI_NUM_CHANNELS; i++) {
+        if (hasTraffic(&snap.in[i])) {
+            printChannelTraffic("in ", i, &snap.in[i]);
+        }
+    }
+    for (i = 0; i < MIDI_NUM_CHANNELS; i++) {
+        if (hasTraffic(&snap.out[i])) {
+            printChannelTraffic("out", i, &snap.out[i]);
+        }
+    }
+    printf(
+        "system bytes %lu, sysex %lu packets %lu bytes\n",
+        (unsigned long)snap.systemBytes, (unsigned long)snap.sysexPackets, (unsigned long)snap.sysexBytes
+    );
+}
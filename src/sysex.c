@@ -0,0 +1,158 @@
+/*
+    SysEx forwarding
+
+    SysEx is passed on as it arrives. A rule keyed on the manufacturer ID
+    and the model ID can rewrite the device ID and recompute a Roland
+    style checksum, which are both done in one pass over the message while
+    it streams through:
+
+        F0 <manufacturer> <device> <model> <command> <address+data> <sum> F7
+
+    Only one byte is ever held back: the device ID until the model ID is
+    known, and with a checksum rule the last byte seen, which turns out to
+    be the checksum when F7 follows it. Messages of manufacturers without a
+    rule are not touched at all.
+*/
+
+#include "midimapper.h"
+
+extern Setup* setup;
+
+/* positions within the message, F0 being 0 */
+#define POS_MANUFACTURER 1
+#define POS_DEVICE       2
+#define POS_MODEL        3
+#define POS_SUMMED       5
+
+/**************************************************************************/
+
+static const SysExRule* findSysExRule(sint32 manufacturer, sint32 model) {
+    const SysExRule* r;
+    for (r = setup->sysexList; r; r = r->next) {
+        if (r->manufacturer == manufacturer && (r->model == SYSEX_ANY_MODEL || r->model == model)) {
+            return r;
+        }
+    }
+    return 0;
+}
+
+/**************************************************************************/
+
+void startSysEx(SysExState* sx) {
+    /* call after the F0 has been sent */
+    sx->rule    = 0;
+    sx->pos     = 0;
+    sx->sum     = 0;
+    sx->holding = false;
+    sx->plain   = false;
+}
+
+/**************************************************************************/
+
+sint32 sysexData(SysExState* sx, uint8* dBuf, sint32 b) {
+    /* passes on a data byte, returns the number of bytes written (0..2) */
+    sint32 pos;
+    if (sx->plain) {
+        dBuf[0] = b;
+        return 1;
+    }
+    pos = ++sx->pos;
+    if (pos == POS_MANUFACTURER) {
+        sx->man   = b;
+        sx->plain = !setup || !setup->sysexMan[b];
+        dBuf[0]   = b;
+        return 1;
+    }
+    if (pos == POS_DEVICE) {
+        /* held until the model ID is known */
+        sx->held    = b;
+        sx->holding = true;
+        return 0;
+    }
+    if (pos == POS_MODEL) {
+        const SysExRule* r = sx->rule = findSysExRule(sx->man, b);
+        if (r && (r->flags & SYSEX_DEVICE)) {
+            sx->held = (sx->held & ~r->deviceMask) | (r->device & r->deviceMask);
+        }
+        dBuf[0] = sx->held;
+        if (!r || !(r->flags & SYSEX_CHECKSUM)) {
+            /* nothing more to do for this message */
+            sx->holding = false;
+            sx->plain   = true;
+            dBuf[1]     = b;
+            return 2;
+        }
+        sx->held = b;
+        return 1;
+    }
+    /* checksum rule: the held byte was not the last one */
+    if (pos - 1 >= POS_SUMMED) {
+        sx->sum += sx->held;
+    }
+    dBuf[0]  = sx->held;
+    sx->held = b;
+    return 1;
+}
+
+/**************************************************************************/
+
+sint32 endSysEx(SysExState* sx, uint8* dBuf) {
+    /* releases a held byte at the end of a message, returns 0..1 bytes */
+    if (!sx->holding) {
+        return 0;
+    }
+    sx->holding = false;
+    if (sx->rule && (sx->rule->flags & SYSEX_CHECKSUM) && sx->pos > POS_SUMMED) {
+        /* the held byte is the checksum */
+        dBuf[0] = (128 - (sx->sum & 0x7F)) & 0x7F;
+    }
+    else {
+        dBuf[0] = sx->held;
+    }
+    return 1;
+}
+
+/**************************************************************************/
+
+sint32 remapSysEx(uint8* msg, sint32 len) {
+    /*
+        Applies the rules to a complete message in place. The output never
+        runs ahead of the input, as at most one byte is held back. Returns
+        the message length.
+    */
+    SysExState sx;
+    uint8*     s   = msg + 1;
+    uint8*     d   = msg + 1;
+    uint8*     end = msg + len;
+    if (len < 3 || msg[1] >= 0x80 || !setup || !setup->sysexMan[msg[1]]) {
+        return len;
+    }
+    startSysEx(&sx);
+    while (s < end && *s < 0x80) {
+        d += sysexData(&sx, d, *s++);
+    }
+    d += endSysEx(&sx, d);
+    while (s < end) {
+        *d++ = *s++;
+    }
+    return d - msg;
+}
+
+/**************************************************************************/
+
+SysExRule* allocSysExRule(Setup* s, sint32 manufacturer, sint32 model) {
+    /* adds a rule to a setup, rules are tried in the order they were added */
+    SysExRule*  r;
+    SysExRule** tail;
+    if (!(r = (SysExRule*)arenaAlloc(&s->arena, sizeof(SysExRule)))) {
+        return 0;
+    }
+    r->manufacturer = manufacturer;
+    r->model        = model;
+    r->deviceMask   = 0x7F;
+    for (tail = &s->sysexList; *tail; tail = &(*tail)->next) {
+    }
+    *tail = r;
+    s->sysexMan[manufacturer & 0x7F] = 1;
+    return r;
+}